@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "thor.h"
 #include "thor_internal.h"
@@ -128,6 +129,10 @@ int thor_open(struct thor_device_id *user_dev_id, int wait,
 	if (!th)
 		return -ENOMEM;
 
+	th->queue_depth = THOR_DEFAULT_QUEUE_DEPTH;
+	th->adaptive_depth = THOR_DEFAULT_QUEUE_DEPTH;
+	th->prefetch = THOR_DEFAULT_PREFETCH;
+
 	found = t_usb_find_device(dev_id, wait, th);
 	if (found <= 0) {
 		ret = -ENODEV;
@@ -156,8 +161,13 @@ close_dev:
 	return ret;
 }
 
+static void t_thor_arena_release(struct t_thor_arena *arena,
+				 thor_device_handle *th);
+
 void thor_close(thor_device_handle *th)
 {
+	thor_set_event_thread(th, 0);
+	t_thor_arena_release(&th->arena, th);
 	t_usb_close_device(th);
 	free(th);
 }
@@ -427,28 +437,225 @@ int thor_odin_end_pit_dump(thor_device_handle *th)
 	return 0;
 }
 
-static int t_thor_submit_chunk(struct t_thor_data_chunk *chunk)
+static inline double t_thor_elapsed(struct timespec *since)
 {
-	int ret;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec)
+		+ (double)(now.tv_nsec - since->tv_nsec) / (1000*1000*1000);
+}
+
+/*
+ * Adjust the queue depth in a TCP Vegas like manner. The smallest
+ * data-to-response latency seen recently approximates the latency of
+ * a chunk which didn't have to wait behind others, so the ratio
+ * between it and the average latency tells how many chunks are
+ * actually queued on the device side. If less than one is queued the
+ * device may idle between responses so we add one more chunk, if more
+ * than two are queued we only waste buffers and remove one.
+ */
+static void t_thor_adapt_depth(struct t_thor_data_transfer *transfer_data,
+			       double latency)
+{
+	double base, queued;
+
+	if (transfer_data->lat_avg)
+		transfer_data->lat_avg = (7*transfer_data->lat_avg + latency)/8;
+	else
+		transfer_data->lat_avg = latency;
+
+	if (!transfer_data->lat_min || latency < transfer_data->lat_min)
+		transfer_data->lat_min = latency;
+
+	/* Wait until the whole queue has been observed with current depth */
+	if (++transfer_data->lat_samples < transfer_data->queue_depth)
+		return;
+
+	base = transfer_data->lat_min;
+	if (transfer_data->lat_min_prev && transfer_data->lat_min_prev < base)
+		base = transfer_data->lat_min_prev;
+
+	queued = transfer_data->queue_depth * (1 - base/transfer_data->lat_avg);
+	if (queued < 1 && transfer_data->queue_depth < THOR_MAX_QUEUE_DEPTH)
+		++transfer_data->queue_depth;
+	else if (queued > 2 && transfer_data->queue_depth > THOR_MIN_QUEUE_DEPTH)
+		--transfer_data->queue_depth;
+
+	if (transfer_data->prefetch)
+		t_prefetch_set_limit(transfer_data->prefetch,
+				     transfer_data->queue_depth
+				     + transfer_data->prefetch_ahead);
+
+	transfer_data->lat_min_prev = transfer_data->lat_min;
+	transfer_data->lat_min = 0;
+	transfer_data->lat_samples = 0;
+}
+
+static void t_thor_update_completion(struct t_thor_data_transfer *transfer_data)
+{
+	/* While cancelling we have to wait for all chunks to come back */
+	if (transfer_data->ret && !transfer_data->cancelling)
+		transfer_data->completed = 1;
+	/* Chunks waiting for data are queued again by sending thread */
+	else if (!transfer_data->chunks_in_flight
+		 && (!transfer_data->starved || transfer_data->ret
+		     || transfer_data->cancelling))
+		transfer_data->completed = 1;
+
+	if (transfer_data->completed && transfer_data->event_thread)
+		t_thor_cq_kick(&transfer_data->cq);
+}
+
+static inline void t_thor_lock(struct t_thor_data_transfer *transfer_data)
+{
+	if (transfer_data->event_thread)
+		pthread_mutex_lock(&transfer_data->lock);
+}
+
+static inline void t_thor_unlock(struct t_thor_data_transfer *transfer_data)
+{
+	if (transfer_data->event_thread)
+		pthread_mutex_unlock(&transfer_data->lock);
+}
+
+static void t_thor_cancel_data(struct t_thor_data_chunk *chunk)
+{
+	int i;
+
+	for (i = 0; i < chunk->nsubs; ++i)
+		t_usb_cancel_transfer(chunk->data_transfers + i);
+}
+
+static int t_thor_submit_chunk(struct t_thor_data_chunk *chunk,
+			       struct t_thor_data_transfer *transfer_data)
+{
+	int i;
+	int ret = 0;
 
 	chunk->data_finished = chunk->resp_finished = 0;
+	chunk->subs_pending = 0;
 
-	ret = t_usb_submit_transfer(&chunk->data_transfer);
-	if (ret)
-		goto out;
+	clock_gettime(CLOCK_MONOTONIC, &chunk->submit_time);
+	for (i = 0; i < chunk->nsubs; ++i) {
+		ret = t_usb_submit_transfer(chunk->data_transfers + i);
+		if (ret)
+			break;
+		++chunk->subs_pending;
+	}
 
-	memset(&chunk->resp, 0, DATA_RES_PKT_SIZE);
-	ret = t_usb_submit_transfer(&chunk->resp_transfer);
-	if (ret)
-		goto cancel_data_transfer;
+	if (!chunk->subs_pending)
+		return ret;
+
+	chunk->busy = 1;
+	++transfer_data->chunks_in_flight;
+	transfer_data->data_in_progress += chunk->useful_size;
+
+	if (!ret) {
+		memset(&chunk->resp, 0, DATA_RES_PKT_SIZE);
+		ret = t_usb_submit_transfer(&chunk->resp_transfer);
+	}
+
+	if (ret) {
+		/* Chunk is done as soon as its data transfers come back */
+		chunk->resp_finished = 1;
+		transfer_data->data_in_progress -= chunk->useful_size;
+		t_thor_cancel_data(chunk);
+	}
 
-	return 0;
-cancel_data_transfer:
-	t_usb_cancel_transfer(&chunk->data_transfer);
-out:
 	return ret;
 }
 
+static void data_transfer_finished(struct t_usb_transfer *_data_transfer);
+
+/* Split the unit into sub-transfers, set up more of them if needed */
+static int t_thor_set_chunk_buffer(struct t_thor_data_chunk *chunk,
+				   struct t_thor_data_transfer *transfer_data)
+{
+	off_t sub_size = transfer_data->sub_transfer_size;
+	off_t offset;
+	int ret;
+	int i;
+
+	chunk->nsubs = (chunk->trans_unit_size + sub_size - 1) / sub_size;
+	for (; chunk->subs_init < chunk->nsubs; ++chunk->subs_init) {
+		ret = t_usb_init_out_transfer(chunk->data_transfers
+					      + chunk->subs_init,
+					      transfer_data->th, NULL, 0,
+					      data_transfer_finished,
+					      DEFAULT_TIMEOUT);
+		if (ret)
+			return ret;
+		chunk->data_transfers[chunk->subs_init].user_data = chunk;
+	}
+
+	for (i = 0, offset = 0; i < chunk->nsubs; ++i, offset += sub_size)
+		t_usb_set_transfer_buffer(chunk->data_transfers + i,
+					  chunk->buf + offset,
+					  chunk->trans_unit_size - offset
+					  > sub_size ? sub_size
+					  : chunk->trans_unit_size - offset);
+
+	return 0;
+}
+
+static void t_thor_put_chunk_data(struct t_thor_data_chunk *chunk,
+				  struct t_thor_data_transfer *transfer_data)
+{
+	struct thor_data_src *data = transfer_data->data;
+
+	if (chunk->pbuf) {
+		t_prefetch_put(transfer_data->prefetch, chunk->pbuf);
+		chunk->pbuf = NULL;
+	} else if (chunk->borrowed) {
+		if (data->release_block)
+			data->release_block(data, chunk->buf,
+					    chunk->useful_size);
+		chunk->borrowed = 0;
+	}
+}
+
+/* Read next block of data to chunk or borrow it from data source */
+static int t_thor_get_chunk_data(struct t_thor_data_chunk *chunk,
+				 struct t_thor_data_transfer *transfer_data)
+{
+	struct thor_data_src *data = transfer_data->data;
+	void *borrowed;
+	off_t ret;
+
+	if (data->borrow_block
+	    && chunk->useful_size == chunk->trans_unit_size) {
+		ret = data->borrow_block(data, &borrowed, chunk->useful_size);
+		if (ret < 0)
+			return ret;
+
+		if (ret) {
+			chunk->buf = borrowed;
+			chunk->borrowed = 1;
+			return 0;
+		}
+	}
+
+	if (!chunk->own_buf) {
+		chunk->own_buf = t_thor_arena_alloc(&transfer_data->th->arena,
+						    transfer_data->th,
+						    &chunk->own_buf_dev_mem);
+		if (!chunk->own_buf)
+			return -ENOMEM;
+	}
+	chunk->buf = chunk->own_buf;
+
+	ret = data->get_block(data, chunk->buf, chunk->useful_size);
+	if (ret != chunk->useful_size)
+		return ret < 0 ? ret : -EIO;
+
+	memset(chunk->buf + chunk->useful_size, 0,
+	       chunk->trans_unit_size - chunk->useful_size);
+
+	return 0;
+}
+
 static int t_thor_prep_next_chunk(struct t_thor_data_chunk *chunk,
 				  struct t_thor_data_transfer *transfer_data)
 {
@@ -462,63 +669,174 @@ static int t_thor_prep_next_chunk(struct t_thor_data_chunk *chunk,
 		return -EINVAL;
 	}
 
+	chunk->user_data = transfer_data;
+	chunk->trans_unit_size = transfer_data->trans_unit_size;
 	chunk->useful_size = to_read > chunk->trans_unit_size ?
 		chunk->trans_unit_size : to_read;
 
-	ret = transfer_data->data->get_block(transfer_data->data,
-					  chunk->buf, chunk->useful_size);
-	if (ret < 0 || ret != chunk->useful_size)
-		return ret;
+	if (transfer_data->event_thread) {
+		/* Event thread must never wait for data */
+		ret = t_prefetch_try_get(transfer_data->prefetch, &chunk->pbuf);
+		if (ret == -EAGAIN)
+			transfer_data->starved = 1;
+		if (ret)
+			return ret;
 
-	memset(chunk->buf + chunk->useful_size, 0,
-	       chunk->trans_unit_size - chunk->useful_size);
+		chunk->buf = chunk->pbuf->data;
+		if (chunk->pbuf->size != chunk->useful_size) {
+			ret = -EIO;
+			goto put_data;
+		}
+	} else if (transfer_data->prefetch) {
+		ret = t_prefetch_get(transfer_data->prefetch, &chunk->pbuf);
+		if (ret)
+			return ret;
+
+		chunk->buf = chunk->pbuf->data;
+		if (chunk->pbuf->size != chunk->useful_size) {
+			ret = -EIO;
+			goto put_data;
+		}
+	} else {
+		ret = t_thor_get_chunk_data(chunk, transfer_data);
+		if (ret)
+			goto put_data;
+	}
+	ret = t_thor_set_chunk_buffer(chunk, transfer_data);
+	if (ret)
+		goto put_data;
 	chunk->chunk_number = transfer_data->chunk_number++;
 
-	ret = t_thor_submit_chunk(chunk);
-	if (!ret)
-		transfer_data->data_in_progress += chunk->useful_size;
+	ret = t_thor_submit_chunk(chunk, transfer_data);
+	if (ret && !chunk->busy)
+		goto put_data;
 
 	return ret;
+put_data:
+	t_thor_put_chunk_data(chunk, transfer_data);
+	return ret;
 }
 
-static void check_next_chunk(struct t_thor_data_chunk *chunk,
-			     struct t_thor_data_transfer *transfer_data)
+static int t_thor_init_chunk(struct t_thor_data_chunk *chunk,
+			     thor_device_handle *th);
+
+static struct t_thor_data_chunk *
+t_thor_get_idle_chunk(struct t_thor_data_transfer *transfer_data,
+		      int *ret)
 {
-	/* If there is some more data to be queued */
-	if (transfer_data->data_left - transfer_data->data_in_progress) {
-		int ret;
+	struct t_thor_arena *arena = &transfer_data->th->arena;
+	struct t_thor_data_chunk *chunk;
+	int i;
+
+	*ret = 0;
+	for (i = 0; i < arena->nchunks; ++i)
+		if (!arena->chunks[i].busy)
+			return arena->chunks + i;
+
+	/* Chunks are set up only when queue grows */
+	if (arena->nchunks >= THOR_MAX_QUEUE_DEPTH)
+		return NULL;
+
+	chunk = arena->chunks + arena->nchunks;
+	*ret = t_thor_init_chunk(chunk, transfer_data->th);
+	if (*ret)
+		return NULL;
+
+	++arena->nchunks;
+	return chunk;
+}
+
+/* Keep queue_depth chunks in flight as long as there is data to send */
+static int t_thor_queue_chunks(struct t_thor_data_transfer *transfer_data)
+{
+	struct t_thor_data_chunk *chunk;
+	int ret = 0;
+
+	transfer_data->starved = 0;
+	while (transfer_data->chunks_in_flight < transfer_data->queue_depth
+	       && transfer_data->data_left - transfer_data->data_in_progress > 0) {
+		chunk = t_thor_get_idle_chunk(transfer_data, &ret);
+		if (!chunk)
+			break;
 
 		ret = t_thor_prep_next_chunk(chunk, transfer_data);
-		if (ret) {
+		if (ret)
+			break;
+	}
+
+	return ret == -EAGAIN ? 0 : ret;
+}
+
+static void t_thor_chunk_finished(struct t_thor_data_chunk *chunk,
+				  struct t_thor_data_transfer *transfer_data)
+{
+	int ret;
+
+	chunk->busy = 0;
+	--transfer_data->chunks_in_flight;
+
+	t_thor_put_chunk_data(chunk, transfer_data);
+
+	/* If there is some more data to be queued */
+	if (!transfer_data->ret && !transfer_data->cancelling) {
+		ret = t_thor_queue_chunks(transfer_data);
+		if (ret)
 			transfer_data->ret = ret;
-			transfer_data->completed = 1;
-		}
-	} else {
-		/* Last one turns the light off */
-		if (transfer_data->data_in_progress == 0)
-			transfer_data->completed = 1;
 	}
+
+	t_thor_update_completion(transfer_data);
 }
 
 static void data_transfer_finished(struct t_usb_transfer *_data_transfer)
 {
-	struct t_thor_data_chunk *chunk = container_of(_data_transfer,
-						       struct t_thor_data_chunk,
-						       data_transfer);
+	struct t_thor_data_chunk *chunk = _data_transfer->user_data;
 	struct t_thor_data_transfer *transfer_data = chunk->user_data;
 
+	t_thor_lock(transfer_data);
+	if (!_data_transfer->cancelled && _data_transfer->ret
+	    && !transfer_data->ret)
+		transfer_data->ret = _data_transfer->ret;
+
+	/* Rest of the unit is useless now, don't wait for it */
+	if (_data_transfer->cancelled || _data_transfer->ret)
+		t_thor_cancel_data(chunk);
+
+	if (--chunk->subs_pending) {
+		t_thor_unlock(transfer_data);
+		return;
+	}
 	chunk->data_finished = 1;
 
-	if (_data_transfer->cancelled || transfer_data->ret)
+	if (chunk->resp_finished)
+		t_thor_chunk_finished(chunk, transfer_data);
+	else
+		t_thor_update_completion(transfer_data);
+	t_thor_unlock(transfer_data);
+}
+
+static void t_thor_report_progress(struct t_thor_data_transfer *transfer_data,
+				   int chunk_number)
+{
+	struct t_thor_cq_entry entry;
+
+	if (!transfer_data->report_progress)
 		return;
 
-	if (_data_transfer->ret) {
-		transfer_data->ret = _data_transfer->ret;
-		transfer_data->completed = 1;
+	if (!transfer_data->event_thread) {
+		transfer_data->report_progress(transfer_data->th,
+					       transfer_data->data,
+					       transfer_data->data_sent,
+					       transfer_data->data_left,
+					       chunk_number,
+					       transfer_data->user_data);
+		return;
 	}
 
-	if (chunk->resp_finished)
-		check_next_chunk(chunk, transfer_data);
+	/* Progress is cumulative so if queue is full entry may be dropped */
+	entry.data_sent = transfer_data->data_sent;
+	entry.data_left = transfer_data->data_left;
+	entry.chunk_number = chunk_number;
+	t_thor_cq_push(&transfer_data->cq, &entry);
 }
 
 static void resp_transfer_finished(struct t_usb_transfer *_resp_transfer)
@@ -528,18 +846,16 @@ static void resp_transfer_finished(struct t_usb_transfer *_resp_transfer)
 						       resp_transfer);
 	struct t_thor_data_transfer *transfer_data = chunk->user_data;
 
+	t_thor_lock(transfer_data);
 	chunk->resp_finished = 1;
 	transfer_data->data_in_progress -= chunk->useful_size;
 
-	if (_resp_transfer->cancelled || transfer_data->ret) {
-		if (transfer_data->data_in_progress == 0)
-			transfer_data->completed = 1;
-		return;
-	}
+	if (_resp_transfer->cancelled || transfer_data->ret)
+		goto out;
 
 	if (_resp_transfer->ret) {
 		transfer_data->ret = _resp_transfer->ret;
-		goto complete_all;
+		goto out;
 	}
 
 	if (chunk->resp.cnt != chunk->chunk_number) {
@@ -547,146 +863,480 @@ static void resp_transfer_finished(struct t_usb_transfer *_resp_transfer)
 			chunk->resp.cnt, chunk->chunk_number);
 		fflush(stdout);
 		transfer_data->ret = -EINVAL;
-		goto complete_all;
+		goto out;
 	}
 
+	if (transfer_data->adaptive)
+		t_thor_adapt_depth(transfer_data,
+				   t_thor_elapsed(&chunk->submit_time));
+
 	transfer_data->data_sent += chunk->useful_size;
 	transfer_data->data_left -= chunk->useful_size;
-	if (transfer_data->report_progress)
-		transfer_data->report_progress(transfer_data->th,
-					       transfer_data->data,
-					       transfer_data->data_sent,
-					       transfer_data->data_left,
-					       chunk->chunk_number,
-					       transfer_data->user_data);
+	t_thor_report_progress(transfer_data, chunk->chunk_number);
 
+out:
 	if (chunk->data_finished)
-		check_next_chunk(chunk, transfer_data);
-
-	return;
-complete_all:
-	transfer_data->completed = 1;
-	return;
+		t_thor_chunk_finished(chunk, transfer_data);
+	else
+		t_thor_update_completion(transfer_data);
+	t_thor_unlock(transfer_data);
 }
 
+/* Buffer of data transfer is set each time the chunk is queued */
 static int t_thor_init_chunk(struct t_thor_data_chunk *chunk,
-			     thor_device_handle *th,
-			     off_t trans_unit_size,
-			     void *user_data)
+			     thor_device_handle *th)
 {
-	int ret;
-
-	chunk->user_data = user_data;
 	chunk->useful_size = 0;
-	chunk->trans_unit_size = trans_unit_size;
-
-	chunk->buf = malloc(trans_unit_size);
-	if (!chunk->buf)
-		return -ENOMEM;
-
-	ret = t_usb_init_out_transfer(&chunk->data_transfer, th, chunk->buf,
-				     trans_unit_size, data_transfer_finished,
-				     DEFAULT_TIMEOUT);
-	if (ret)
-		goto free_buf;
-
-	ret = t_usb_init_in_transfer(&chunk->resp_transfer, th,
-				     (unsigned char *)&chunk->resp,
+	chunk->busy = 0;
+	chunk->buf = NULL;
+	chunk->own_buf = NULL;
+	chunk->borrowed = 0;
+	chunk->pbuf = NULL;
+	/* Data transfers are set up when unit size is known */
+	chunk->nsubs = 0;
+	chunk->subs_init = 0;
+
+	return t_usb_init_in_transfer(&chunk->resp_transfer, th,
+				      (unsigned char *)&chunk->resp,
 				      DATA_RES_PKT_SIZE,
 				      resp_transfer_finished,
 				      2*DEFAULT_TIMEOUT);
-	if (ret)
-		goto cleanup_data_transfer;
+}
+
+static void t_thor_cleanup_chunk(struct t_thor_data_chunk *chunk)
+{
+	int i;
+
+	for (i = 0; i < chunk->subs_init; ++i)
+		t_usb_cleanup_transfer(chunk->data_transfers + i);
+	t_usb_cleanup_transfer(&chunk->resp_transfer);
+}
+
+unsigned char *t_thor_arena_alloc(struct t_thor_arena *arena,
+				  thor_device_handle *th, int *dev_mem)
+{
+	unsigned char *buf;
+
+	buf = t_usb_alloc_buffer(th, arena->buf_size, dev_mem);
+	if (!buf)
+		return NULL;
+
+	if (*dev_mem)
+		++arena->n_dev_mem;
+	else
+		++arena->n_heap;
+
+	return buf;
+}
+
+static void t_thor_arena_free(struct t_thor_arena *arena,
+			      thor_device_handle *th,
+			      unsigned char *buf, int dev_mem)
+{
+	if (!buf)
+		return;
+
+	t_usb_free_buffer(th, buf, arena->buf_size, dev_mem);
+	if (dev_mem)
+		--arena->n_dev_mem;
+	else
+		--arena->n_heap;
+}
+
+static void t_thor_arena_free_bufs(struct t_thor_arena *arena,
+				   thor_device_handle *th)
+{
+	struct t_thor_data_chunk *chunk;
+	struct t_prefetch_buf *pbuf;
+	int i;
+
+	for (i = 0; i < arena->nchunks; ++i) {
+		chunk = arena->chunks + i;
+		t_thor_arena_free(arena, th, chunk->own_buf,
+				  chunk->own_buf_dev_mem);
+		chunk->own_buf = NULL;
+	}
+
+	if (!arena->bufs)
+		return;
+
+	for (i = 0; i < T_THOR_ARENA_BUFS; ++i) {
+		pbuf = arena->bufs + i;
+		t_thor_arena_free(arena, th, pbuf->buf, pbuf->dev_mem);
+		pbuf->buf = NULL;
+	}
+}
+
+/*
+ * Chunks with their usb transfers and all data buffers are kept in the
+ * device handle and reused for every file. Buffers are reallocated only
+ * when the target asks for a bigger transfer unit than ever before.
+ */
+static int t_thor_arena_prepare(struct t_thor_arena *arena,
+				thor_device_handle *th, off_t trans_unit_size)
+{
+	if (!arena->chunks) {
+		arena->chunks = calloc(THOR_MAX_QUEUE_DEPTH,
+				       sizeof(*arena->chunks));
+		if (!arena->chunks)
+			return -ENOMEM;
+	}
+
+	if (!arena->bufs) {
+		arena->bufs = calloc(T_THOR_ARENA_BUFS, sizeof(*arena->bufs));
+		if (!arena->bufs)
+			return -ENOMEM;
+	}
+
+	if (trans_unit_size <= arena->buf_size)
+		return 0;
+
+	t_thor_arena_free_bufs(arena, th);
+	arena->buf_size = trans_unit_size;
 
 	return 0;
-cleanup_data_transfer:
-	t_usb_cleanup_transfer(&chunk->data_transfer);
-free_buf:
-	free(chunk->buf);
+}
 
-	return ret;
+static void t_thor_arena_release(struct t_thor_arena *arena,
+				 thor_device_handle *th)
+{
+	int i;
+
+	/* Device memory has to be given back before device is closed */
+	t_thor_arena_free_bufs(arena, th);
+
+	for (i = 0; i < arena->nchunks; ++i)
+		t_thor_cleanup_chunk(arena->chunks + i);
+	free(arena->chunks);
+	free(arena->bufs);
+
+	memset(arena, 0, sizeof(*arena));
 }
 
-static void t_thor_cleanup_chunk(struct t_thor_data_chunk *chunk)
+static void t_thor_report_entry(struct t_thor_data_transfer *transfer_data,
+				off_t data_sent, off_t data_left,
+				int chunk_number)
 {
-	t_usb_cleanup_transfer(&chunk->data_transfer);
-	t_usb_cleanup_transfer(&chunk->resp_transfer);
-	free(chunk->buf);
+	transfer_data->report_progress(transfer_data->th, transfer_data->data,
+				       data_sent, data_left, chunk_number,
+				       transfer_data->user_data);
+	transfer_data->data_reported = data_sent;
+}
+
+/*
+ * Callbacks are run by event thread, here we only report progress and
+ * queue chunks which had to wait for data.
+ */
+static int t_thor_wait_event_thread(struct t_thor_data_transfer *transfer_data)
+{
+	struct thor_stats *stats = &transfer_data->th->stats;
+	struct t_thor_cq_entry entry;
+	struct timespec wall_start, cpu_start, cpu_end;
+	int completed;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+
+	while (1) {
+		while (t_thor_cq_pop(&transfer_data->cq, &entry))
+			t_thor_report_entry(transfer_data, entry.data_sent,
+					    entry.data_left,
+					    entry.chunk_number);
+
+		t_thor_lock(transfer_data);
+		if (transfer_data->starved && !transfer_data->completed
+		    && !transfer_data->ret && !transfer_data->cancelling) {
+			ret = t_thor_queue_chunks(transfer_data);
+			if (ret)
+				transfer_data->ret = ret;
+			t_thor_update_completion(transfer_data);
+		}
+		completed = transfer_data->completed;
+		t_thor_unlock(transfer_data);
+
+		if (completed)
+			break;
+
+		t_thor_cq_wait(&transfer_data->cq);
+		++stats->event_wakeups;
+	}
+
+	while (t_thor_cq_pop(&transfer_data->cq, &entry))
+		t_thor_report_entry(transfer_data, entry.data_sent,
+				    entry.data_left, entry.chunk_number);
+
+	/* Some entries could have been dropped if queue was full */
+	if (transfer_data->data_sent > transfer_data->data_reported)
+		t_thor_report_entry(transfer_data, transfer_data->data_sent,
+				    transfer_data->data_left,
+				    transfer_data->chunk_number - 1);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	stats->event_wall_time += t_thor_elapsed(&wall_start);
+	stats->event_cpu_time += (cpu_end.tv_sec - cpu_start.tv_sec)
+		+ (double)(cpu_end.tv_nsec - cpu_start.tv_nsec)
+		/ (1000*1000*1000);
+
+	return 0;
 }
 
 static inline int
 t_thor_handle_events(struct t_thor_data_transfer *transfer_data)
 {
-	return t_usb_handle_events_completed(&transfer_data->completed);
+	if (transfer_data->event_thread)
+		return t_thor_wait_event_thread(transfer_data);
+
+	return t_usb_handle_events_completed(transfer_data->th,
+					     &transfer_data->completed);
 }
 
 static inline void t_thor_cancel_chunk(struct t_thor_data_chunk *chunk)
 {
-	t_usb_cancel_transfer(&chunk->data_transfer);
+	t_thor_cancel_data(chunk);
 	t_usb_cancel_transfer(&chunk->resp_transfer);
 }
 
+int thor_set_queue_depth(thor_device_handle *th, int depth)
+{
+	if (depth != THOR_QUEUE_DEPTH_ADAPTIVE
+	    && (depth < 1 || depth > THOR_MAX_QUEUE_DEPTH))
+		return -EINVAL;
+
+	th->queue_depth = depth;
+	th->adaptive_depth = THOR_DEFAULT_QUEUE_DEPTH;
+
+	return 0;
+}
+
+int thor_set_prefetch(thor_device_handle *th, int ahead)
+{
+	if (ahead < 0 || ahead > THOR_MAX_QUEUE_DEPTH)
+		return -EINVAL;
+
+	th->prefetch = ahead;
+
+	return 0;
+}
+
+int thor_set_sub_transfer_size(thor_device_handle *th, off_t size)
+{
+	if (size < 0)
+		return -EINVAL;
+
+	th->sub_transfer_size = size;
+
+	return 0;
+}
+
+/* Each but the last sub-transfer has to end at a packet boundary */
+static off_t t_thor_get_sub_transfer_size(thor_device_handle *th,
+					  off_t trans_unit_size)
+{
+	off_t mps = th->data_ep_out_mps ? th->data_ep_out_mps : 512;
+	off_t size = th->sub_transfer_size;
+	off_t min_size;
+
+	if (size == THOR_SUB_TRANSFER_AUTO)
+		size = t_usb_get_auto_sub_transfer_size(th);
+
+	min_size = (trans_unit_size + T_THOR_MAX_SUB_TRANSFERS - 1)
+		/ T_THOR_MAX_SUB_TRANSFERS;
+	if (size < min_size)
+		size = min_size;
+
+	size = (size + mps - 1) / mps * mps;
+	if (size > trans_unit_size)
+		size = trans_unit_size;
+
+	return size;
+}
+
+int thor_set_event_thread(thor_device_handle *th, int enable)
+{
+	int ret;
+
+	enable = !!enable;
+	if (enable == th->event_thread)
+		return 0;
+
+	if (enable) {
+		ret = t_thor_event_thread_get();
+		if (ret)
+			return ret;
+	} else {
+		t_thor_event_thread_put();
+	}
+
+	th->event_thread = enable;
+
+	return 0;
+}
+
+int thor_get_queue_depth(thor_device_handle *th)
+{
+	if (th->queue_depth == THOR_QUEUE_DEPTH_ADAPTIVE)
+		return th->adaptive_depth;
+
+	return th->queue_depth;
+}
+
+int thor_get_stats(thor_device_handle *th, struct thor_stats *stats)
+{
+	*stats = th->stats;
+	return 0;
+}
+
+enum thor_buffer_mode thor_get_buffer_mode(thor_device_handle *th)
+{
+	struct t_thor_arena *arena = &th->arena;
+
+	if (arena->n_dev_mem && arena->n_heap)
+		return THOR_BUFFER_MIXED;
+	if (arena->n_dev_mem)
+		return THOR_BUFFER_DEV_MEM;
+	if (arena->n_heap)
+		return THOR_BUFFER_HEAP;
+
+	return THOR_BUFFER_NONE;
+}
+
+/*
+ * Prefetch thread is kept running between entries as long as transfer
+ * unit doesn't change. Otherwise data which has been read ahead is moved
+ * to a new one with proper buffer size.
+ */
+static int t_thor_prefetch_prepare(struct t_prefetch *prefetch,
+				   thor_device_handle *th,
+				   struct thor_data_src *data,
+				   off_t trans_unit_size, off_t data_left,
+				   int ahead, int nbufs, int limit)
+{
+	unsigned char *leftover = NULL;
+	off_t leftover_len = 0;
+	int ret;
+
+	if (prefetch->running) {
+		if (!data_left || prefetch->buf_size == trans_unit_size)
+			return 0;
+
+		ret = t_prefetch_stop(prefetch, &leftover, &leftover_len);
+		if (ret)
+			return ret;
+	}
+
+	ret = t_thor_arena_prepare(&th->arena, th, trans_unit_size);
+	if (ret)
+		goto free_leftover;
+
+	if (!ahead || !data_left)
+		goto free_leftover;
+
+	/* Takes over leftover */
+	return t_prefetch_start(prefetch, th, data, data_left,
+				trans_unit_size, nbufs, limit,
+				leftover, leftover_len);
+
+free_leftover:
+	free(leftover);
+	return ret;
+}
+
 static int t_thor_send_raw_data(thor_device_handle *th,
 				struct thor_data_src *data,
 				off_t trans_unit_size,
+				struct t_prefetch *prefetch,
 				thor_progress_cb report_progress,
 				void *user_data)
 {
-	struct t_thor_data_chunk chunk[3];
+	struct t_thor_arena *arena = &th->arena;
 	struct t_thor_data_transfer transfer_data;
-	int i, j;
+	int prefetch_ahead;
+	int nbufs;
+	int cancel;
+	int i;
 	int ret;
 
-	for (i = 0; i < ARRAY_SIZE(chunk); ++i) {
-		ret = t_thor_init_chunk(chunk + i, th, trans_unit_size,
-					&transfer_data);
-		if (ret)
-			goto cleanup_chunks;
-	}
-
+	memset(&transfer_data, 0, sizeof(transfer_data));
+	transfer_data.th = th;
 	transfer_data.data = data;
 	transfer_data.report_progress = report_progress;
 	transfer_data.user_data = user_data;
+	transfer_data.trans_unit_size = trans_unit_size;
+	transfer_data.sub_transfer_size =
+		t_thor_get_sub_transfer_size(th, trans_unit_size);
 	transfer_data.data_left = data->get_file_length(data);
-	transfer_data.data_sent = 0;
 	transfer_data.chunk_number = 1;
-	transfer_data.completed = 0;
-	transfer_data.data_in_progress = 0;
-	transfer_data.ret = 0;
-
-	for (i = 0;
-	     i < ARRAY_SIZE(chunk)
-	      && (transfer_data.data_left - transfer_data.data_in_progress > 0);
-	     ++i) {
-		ret = t_thor_prep_next_chunk(chunk + i, &transfer_data);
-		if (ret)
-			goto cancel_chunks;
+	transfer_data.adaptive =
+		th->queue_depth == THOR_QUEUE_DEPTH_ADAPTIVE;
+	transfer_data.queue_depth = thor_get_queue_depth(th);
+	transfer_data.event_thread = th->event_thread;
+
+	prefetch_ahead = th->prefetch;
+	if (transfer_data.event_thread) {
+		/* Event thread must not read data itself */
+		if (!prefetch_ahead)
+			prefetch_ahead = 1;
+		pthread_mutex_init(&transfer_data.lock, NULL);
+		t_thor_cq_init(&transfer_data.cq);
 	}
 
-	t_thor_handle_events(&transfer_data);
-
-	if (transfer_data.data_in_progress) {
-		ret = transfer_data.ret;
-		goto cancel_chunks;
+	nbufs = (transfer_data.adaptive ? THOR_MAX_QUEUE_DEPTH
+		 : transfer_data.queue_depth) + prefetch_ahead;
+	ret = t_thor_prefetch_prepare(prefetch, th, data, trans_unit_size,
+				      transfer_data.data_left, prefetch_ahead,
+				      nbufs,
+				      transfer_data.queue_depth + prefetch_ahead);
+	if (ret)
+		goto cleanup;
+
+	if (prefetch->running) {
+		transfer_data.prefetch = prefetch;
+		transfer_data.prefetch_ahead = prefetch_ahead;
+		t_prefetch_set_limit(prefetch, transfer_data.queue_depth
+				     + prefetch_ahead);
+		t_prefetch_set_cq(prefetch, transfer_data.event_thread ?
+				  &transfer_data.cq : NULL);
+		/* Next entry may be opened once this one has been read */
+		t_prefetch_advance(prefetch);
 	}
 
-	for (i = 0; i < ARRAY_SIZE(chunk); ++i)
-		t_thor_cleanup_chunk(chunk + i);
+	t_thor_lock(&transfer_data);
+	ret = t_thor_queue_chunks(&transfer_data);
+	if (ret)
+		transfer_data.ret = ret;
+	t_thor_update_completion(&transfer_data);
+	t_thor_unlock(&transfer_data);
 
-	return transfer_data.ret;
+	if (!transfer_data.ret)
+		t_thor_handle_events(&transfer_data);
 
-cancel_chunks:
-	for (j = 0; j < i; ++j)
-		t_thor_cancel_chunk(chunk + j);
-	if (i) {
+	t_thor_lock(&transfer_data);
+	cancel = transfer_data.chunks_in_flight;
+	if (cancel) {
+		transfer_data.cancelling = 1;
 		transfer_data.completed = 0;
-		t_thor_handle_events(&transfer_data);
+		for (i = 0; i < arena->nchunks; ++i)
+			if (arena->chunks[i].busy)
+				t_thor_cancel_chunk(arena->chunks + i);
 	}
+	t_thor_unlock(&transfer_data);
 
-	i = ARRAY_SIZE(chunk);
-cleanup_chunks:
-	for (j = 0; j < i; ++j)
-		t_thor_cleanup_chunk(chunk + j);
+	if (cancel)
+		t_thor_handle_events(&transfer_data);
+
+	if (transfer_data.adaptive)
+		th->adaptive_depth = transfer_data.queue_depth;
+
+	if (transfer_data.prefetch)
+		t_prefetch_set_cq(transfer_data.prefetch, NULL);
+
+	ret = transfer_data.ret;
+cleanup:
+	if (transfer_data.event_thread) {
+		t_thor_cq_destroy(&transfer_data.cq);
+		pthread_mutex_destroy(&transfer_data.lock);
+	}
 
 	return ret;
 }
@@ -701,14 +1351,24 @@ int thor_send_data(thor_device_handle *th, struct thor_data_src *data,
 	struct res_pkt resp;
 	int32_t int_data[2];
 	off_t trans_unit_size;
+	struct t_prefetch prefetch;
 	int ret;
 
+	/* Once started, prefetch thread opens the entries */
+	prefetch.running = 0;
+
 	while (1) {
-		ret = data->next_file(data);
+		if (prefetch.running)
+			ret = t_prefetch_next_entry(&prefetch);
+		else
+			ret = data->next_file(data);
 		if (ret <= 0)
 			break;
-		if (report_next_entry)
-			report_next_entry(th, data, ne_cb_data);
+		if (report_next_entry) {
+			ret = report_next_entry(th, data, ne_cb_data);
+			if (ret)
+				goto out;
+		}
 
 		filesize = data->get_file_length(data);
 		filename = data->get_name(data);
@@ -723,7 +1383,7 @@ int thor_send_data(thor_device_handle *th, struct thor_data_src *data,
 					   int_data, ARRAY_SIZE(int_data),
 					   (char **)&filename, 1, &resp);
 		if (ret < 0)
-			return ret;
+			goto out;
 
 		trans_unit_size = resp.int_data[0];
 
@@ -731,23 +1391,29 @@ int thor_send_data(thor_device_handle *th, struct thor_data_src *data,
 			ret = t_thor_exec_cmd(th, RQT_DL, RQT_DL_FILE_START,
 					      NULL, 0);
 			if (ret < 0)
-				return ret;
+				goto out;
 		}
 
 		ret = t_thor_send_raw_data(th, data, trans_unit_size,
-					   report_progress, user_data);
+					   &prefetch, report_progress,
+					   user_data);
 		if (ret < 0)
-			return ret;
+			goto out;
 
 		if (th) {
 			ret = t_thor_exec_cmd(th, RQT_DL, RQT_DL_FILE_END,
 					      NULL, 0);
 			if (ret < 0)
-				return ret;
+				goto out;
 		}
 	}
 
-	return 0;
+	ret = 0;
+out:
+	if (prefetch.running)
+		t_prefetch_stop(&prefetch, NULL, NULL);
+
+	return ret;
 }
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -860,8 +1526,11 @@ int thor_odin_recv_pit_data(thor_device_handle *th, uint32_t chunk_size,
 		fprintf(stderr, "invalid data dest\n");
 		return -EBADF;
 	}
-	if (report_next_entry)
-		report_next_entry(th, data, ne_cb_data);
+	if (report_next_entry) {
+		ret = report_next_entry(th, data, ne_cb_data);
+		if (ret)
+			return ret;
+	}
 
 	if (!th) {
 		fprintf(stderr, "skipping chunk recv\n");
@@ -930,15 +1599,22 @@ int thor_odin_reboot(thor_device_handle *th)
 
 int thor_get_data_src(const char *path, enum thor_data_src_format format,
 		      struct thor_data_src **data)
+{
+	return thor_get_data_src_opts(path, format, NULL, data);
+}
+
+int thor_get_data_src_opts(const char *path, enum thor_data_src_format format,
+			   struct thor_data_src_opts *opts,
+			   struct thor_data_src **data)
 {
 	int ret;
 
 	switch (format) {
 	case THOR_FORMAT_RAW:
-		ret = t_file_get_data_src(path, data);
+		ret = t_file_get_data_src(path, opts, data);
 		break;
 	case THOR_FORMAT_TAR:
-		ret = t_tar_get_data_src(path, data);
+		ret = t_tar_get_data_src(path, opts, data);
 		break;
 	default:
 		ret = -ENOTSUP;
@@ -949,12 +1625,19 @@ int thor_get_data_src(const char *path, enum thor_data_src_format format,
 
 int thor_get_data_dest(const char *path, enum thor_data_src_format format,
 		      struct thor_data_src **data)
+{
+	return thor_get_data_dest_opts(path, format, NULL, data);
+}
+
+int thor_get_data_dest_opts(const char *path, enum thor_data_src_format format,
+			    struct thor_data_src_opts *opts,
+			    struct thor_data_src **data)
 {
 	int ret;
 
 	switch (format) {
 	case THOR_FORMAT_RAW:
-		ret = t_file_get_data_dest(path, data);
+		ret = t_file_get_data_dest(path, opts, data);
 		break;
 	default:
 		/* THOR_FORMAT_TAR not yet supported as a dest */
@@ -32,6 +32,8 @@ struct thor_device_id {
 struct thor_device_handle;
 typedef struct thor_device_handle thor_device_handle;
 
+struct thor_decompress_stats;
+
 enum thor_data_type {
 	THOR_NORMAL_DATA = 0,
 	THOR_PIT_DATA,
@@ -48,25 +50,131 @@ struct thor_data_src {
 	off_t (*get_size)(struct thor_data_src *src);
 	off_t (*get_block)(struct thor_data_src *src, void *data, off_t len);
 	off_t (*put_block)(struct thor_data_src *src, void *data, off_t len);
+	/*
+	 * Optional zero-copy variant of get_block(). On success *data points
+	 * to len bytes which stay valid until passed to release_block() (if
+	 * set). Returns len, 0 if this block has to be read with get_block()
+	 * or negative error code.
+	 */
+	off_t (*borrow_block)(struct thor_data_src *src, void **data, off_t len);
+	void (*release_block)(struct thor_data_src *src, void *data, off_t len);
 	const char *(*get_name)(struct thor_data_src *src);
 	int (*next_file)(struct thor_data_src *src);
 	struct thor_data_src_entry **(*get_entries)(struct thor_data_src *src);
+	/*
+	 * Optional. Returns non-zero if get_size() and get_entries() are
+	 * cheap, zero if they have to read through all the data first. Once
+	 * all the data has been sent they are always cheap.
+	 */
+	int (*has_index)(struct thor_data_src *src);
+	/* Optional. Fails if data is not decompressed by libthor threads */
+	int (*get_decompress_stats)(struct thor_data_src *src,
+				    struct thor_decompress_stats *stats);
 	void (*release)(struct thor_data_src *src);
 };
 
+#define THOR_DEFAULT_QUEUE_DEPTH	3
+#define THOR_MIN_QUEUE_DEPTH		2
+#define THOR_MAX_QUEUE_DEPTH		32
+/* Tune the number of transfer units in flight at runtime */
+#define THOR_QUEUE_DEPTH_ADAPTIVE	0
+
+#define THOR_DEFAULT_PREFETCH		4
+
+enum thor_buffer_mode {
+	THOR_BUFFER_NONE = 0,	/* Nothing allocated yet */
+	THOR_BUFFER_HEAP,
+	THOR_BUFFER_DEV_MEM,	/* DMA-able usbfs memory, no copy on submit */
+	THOR_BUFFER_MIXED,
+};
+
+/* Counters accumulated over the lifetime of a handle */
+struct thor_stats {
+	/*
+	 * Returns from waiting for usb events, or for completions posted
+	 * by the event thread if it is in use
+	 */
+	unsigned long event_wakeups;
+	/* Time spent in event loop, including completion handling */
+	double event_wall_time;
+	double event_cpu_time;
+};
+
 enum thor_data_src_format {
 	THOR_FORMAT_RAW = 0,
 	THOR_FORMAT_TAR,
 };
 
+/* Use one thread per online cpu */
+#define THOR_DECOMPRESS_THREADS_AUTO	0
+#define THOR_MAX_DECOMPRESS_THREADS	64
+
+struct thor_decompress_stats {
+	int nthreads;
+	struct {
+		unsigned long long bytes;	/* Decompressed */
+		double busy_time;
+	} threads[THOR_MAX_DECOMPRESS_THREADS];
+};
+
+#define THOR_READAHEAD_AUTO		0
+#define THOR_READAHEAD_NONE		(-1)
+
+#define THOR_COMPRESS_NONE		0
+#define THOR_COMPRESS_ZSTD		1
+#define THOR_COMPRESS_LZ4		2
+
+struct thor_data_src_opts {
+	/*
+	 * Keep index of tar archive entries in <path>.thor-idx and use it
+	 * next time if the archive hasn't changed. Access points of gzip
+	 * archives are kept in <path>.thor-gzi.
+	 */
+	int index_cache;
+	/*
+	 * Threads decompressing gzip, bzip2, zstd, xz and lz4 archives, 1
+	 * leaves it all to libarchive. Sources opened without options use
+	 * THOR_DECOMPRESS_THREADS_AUTO.
+	 */
+	int decompress_threads;
+	/*
+	 * Bytes of images and uncompressed archives read ahead of what is
+	 * being sent, THOR_READAHEAD_AUTO picks default window and
+	 * THOR_READAHEAD_NONE leaves it all to the kernel
+	 */
+	off_t readahead;
+	/*
+	 * Drop pages of images and uncompressed archives from page cache
+	 * once they have been sent, so flashing doesn't evict everything else
+	 */
+	int drop_cache;
+	/*
+	 * Read raw images with O_DIRECT, bypassing page cache, if their
+	 * filesystem allows it. Images are not mapped then.
+	 */
+	int direct_io;
+	/*
+	 * Don't use io_uring, even if kernel has it, for images which are
+	 * not mapped and for dumps. Dumps are written by a thread then.
+	 */
+	int no_io_uring;
+	/*
+	 * Dumps are written as zstd or lz4 stream, compressed by a pool of
+	 * threads. Level 0 is the default level of the format.
+	 */
+	int compress;
+	int compress_level;
+};
+
 typedef void (*thor_progress_cb)(thor_device_handle *th,
 				 struct thor_data_src *data,
 				 unsigned int sent, unsigned int left,
 				 int chunk_nmb, void *user_data);
 
-typedef void (*thor_next_entry_cb)(thor_device_handle *th,
-				 struct thor_data_src *data,
-				 void *user_data);
+/* Non-zero return stops the transfer with that error */
+typedef int (*thor_next_entry_cb)(thor_device_handle *th,
+				  struct thor_data_src *data,
+				  void *user_data);
 
 /* Init the Thor library */
 int thor_init();
@@ -84,6 +192,45 @@ int thor_open(struct thor_device_id *dev_id, int wait,
 /* Close the device */
 void thor_close(thor_device_handle *th);
 
+/*
+ * Set the number of transfer units kept in flight while sending data
+ * or THOR_QUEUE_DEPTH_ADAPTIVE to adjust it to the measured latency
+ */
+int thor_set_queue_depth(thor_device_handle *th, int depth);
+
+/* Get the number of transfer units currently kept in flight */
+int thor_get_queue_depth(thor_device_handle *th);
+
+/*
+ * Set the number of transfer units read ahead from the data source by
+ * a separate thread, 0 reads each unit just before it is submitted
+ */
+int thor_set_prefetch(thor_device_handle *th, int ahead);
+
+/*
+ * Handle usb events in a thread owned by libthor, shared by all devices.
+ * Transfers are resubmitted from that thread, progress callbacks are
+ * still called from the thread which sends data. Data is always read
+ * ahead by at least one transfer unit in this mode.
+ */
+int thor_set_event_thread(thor_device_handle *th, int enable);
+
+#define THOR_SUB_TRANSFER_AUTO		0
+
+/*
+ * Set the size of single bulk transfer, each transfer unit is split into
+ * transfers of this size which are in flight together. It's rounded to
+ * max packet size of the endpoint. THOR_SUB_TRANSFER_AUTO picks size
+ * based on usbfs memory limit.
+ */
+int thor_set_sub_transfer_size(thor_device_handle *th, off_t size);
+
+/* Check what kind of memory is used for transfer buffers */
+enum thor_buffer_mode thor_get_buffer_mode(thor_device_handle *th);
+
+/* Get usage statistics of given handle */
+int thor_get_stats(thor_device_handle *th, struct thor_stats *stats);
+
 /* Start thor "session" */
 int thor_start_session(thor_device_handle *th, off_t total);
 
@@ -100,10 +247,20 @@ int thor_end_session(thor_device_handle *th);
 int thor_get_data_src(const char *path, enum thor_data_src_format format,
 		      struct thor_data_src **data);
 
+/* Same as above with additional options, opts may be NULL */
+int thor_get_data_src_opts(const char *path, enum thor_data_src_format format,
+			   struct thor_data_src_opts *opts,
+			   struct thor_data_src **data);
+
 /* Open a standard file as data sink for thor */
 int thor_get_data_dest(const char *path, enum thor_data_src_format format,
 		       struct thor_data_src **data);
 
+/* Same as above with additional options, opts may be NULL */
+int thor_get_data_dest_opts(const char *path, enum thor_data_src_format format,
+			    struct thor_data_src_opts *opts,
+			    struct thor_data_src **data);
+
 /* Release data source */
 void thor_release_data_src(struct thor_data_src *data);
 
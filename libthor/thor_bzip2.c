@@ -0,0 +1,490 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parallel decompression of bzip2 archives held in memory.
+ *
+ * Blocks of bzip2 stream are independent but not byte aligned. They are
+ * found by looking for block and end of stream magic at every bit offset.
+ * Each block is copied into a single block stream of its own and decoded
+ * by libbz2, which checks block CRC. Magic may show up inside of block
+ * data by chance. Both halves fail to decode then and are decoded again
+ * as one.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <bzlib.h>
+
+#include "thor_internal.h"
+
+#define BZ_BLOCK_MAGIC		0x314159265359ULL
+#define BZ_EOS_MAGIC		0x177245385090ULL
+#define BZ_MAGIC_BITS		48
+/* Block compressed with biggest block size can't get longer than that */
+#define BZ_MAX_BLOCK_BITS	(8ULL * 1024 * 1024 * 8)
+
+enum bz_mark {
+	BZ_MARK_BLOCK,
+	BZ_MARK_EOS,
+	BZ_MARK_END,	/* end of data */
+};
+
+struct bz_job {
+	struct t_decomp_job job;
+	/* Bit offsets of block magic and of magic which follows */
+	uint64_t start;
+	uint64_t end;
+	enum bz_mark end_mark;
+	uint32_t block_crc;
+
+	bz_stream strm;
+	int strm_init;
+	/* Block wrapped into stream of its own */
+	char *in;
+	uint64_t len;
+};
+
+struct t_bzip2 {
+	struct t_decomp dc;
+	const unsigned char *data;
+	uint64_t size;
+
+	/* Bit offset to look for magic from */
+	uint64_t scan;
+	/* Mark found, not used as job start yet */
+	int pending;
+	uint64_t pending_pos;
+	enum bz_mark pending_mark;
+
+	/* Bit offset where next block has to start */
+	uint64_t expect;
+	uint32_t stream_crc;
+
+	/* Third byte of magic at each bit offset, EOS magic in high byte */
+	uint16_t tab[256];
+};
+
+/* Get up to 57 bits at given bit offset, zeros past the end */
+static uint64_t bz_bits(struct t_bzip2 *bz, uint64_t pos, int n)
+{
+	uint64_t byte = pos / 8;
+	uint64_t w = 0;
+	int i;
+
+	for (i = 0; i < 8; ++i)
+		w = w << 8 | (byte + i < bz->size ? bz->data[byte + i] : 0);
+
+	return (w << (pos % 8)) >> (64 - n);
+}
+
+static int bz_stream_header(const unsigned char *p)
+{
+	return p[0] == 'B' && p[1] == 'Z' && p[2] == 'h'
+		&& p[3] >= '1' && p[3] <= '9';
+}
+
+int t_bzip2_probe(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	return size >= 14 && bz_stream_header(p)
+		&& (!memcmp(p + 4, "\x31\x41\x59\x26\x53\x59", 6)
+		    || !memcmp(p + 4, "\x17\x72\x45\x38\x50\x90", 6));
+}
+
+static void bz_init_tab(struct t_bzip2 *bz)
+{
+	int s;
+
+	for (s = 0; s < 8; ++s) {
+		bz->tab[(BZ_BLOCK_MAGIC << (16 - s)) >> 40 & 0xff] |= 1 << s;
+		bz->tab[(BZ_EOS_MAGIC << (16 - s)) >> 40 & 0xff] |= 1 << (8 + s);
+	}
+}
+
+/*
+ * Find first magic at or after given bit offset. Every magic position
+ * has the same byte in its third byte, so only bytes matching
+ * the table are looked at closer.
+ */
+static uint64_t bz_find_mark(struct t_bzip2 *bz, uint64_t from,
+			     enum bz_mark *mark)
+{
+	uint64_t q, pos, magic;
+	unsigned int m;
+	int s;
+
+	for (q = from / 8 + 2; q < bz->size; ++q) {
+		m = bz->tab[bz->data[q]];
+		if (!m)
+			continue;
+
+		for (s = 0; s < 16; ++s) {
+			if (!(m & 1 << s))
+				continue;
+
+			pos = (q - 2) * 8 + s % 8;
+			if (pos < from || pos + BZ_MAGIC_BITS > bz->size * 8)
+				continue;
+
+			magic = bz_bits(bz, pos, BZ_MAGIC_BITS);
+			if (s < 8 && magic == BZ_BLOCK_MAGIC) {
+				*mark = BZ_MARK_BLOCK;
+				return pos;
+			}
+			if (s >= 8 && magic == BZ_EOS_MAGIC) {
+				*mark = BZ_MARK_EOS;
+				return pos;
+			}
+		}
+	}
+
+	*mark = BZ_MARK_END;
+	return bz->size * 8;
+}
+
+static void bz_job_reset(struct bz_job *job)
+{
+	if (job->strm_init)
+		BZ2_bzDecompressEnd(&job->strm);
+	job->strm_init = 0;
+	free(job->in);
+	job->in = NULL;
+}
+
+static void bz_free_job(struct t_decomp_job *djob)
+{
+	struct bz_job *job = container_of(djob, struct bz_job, job);
+
+	bz_job_reset(job);
+	free(job);
+}
+
+struct bz_writer {
+	unsigned char *p;
+	uint64_t acc;
+	int n;
+};
+
+static void bz_put(struct bz_writer *w, uint64_t val, int n)
+{
+	w->acc = w->acc << n | val;
+	w->n += n;
+	while (w->n >= 8) {
+		w->n -= 8;
+		*w->p++ = w->acc >> w->n;
+	}
+}
+
+/*
+ * Stream holding just this block has the same CRC as the block itself.
+ * Biggest block size is claimed, libbz2 needs it only as upper limit.
+ */
+static int bz_job_init(struct t_bzip2 *bz, struct bz_job *job)
+{
+	uint64_t nbits = job->end - job->start;
+	struct bz_writer w;
+	uint64_t pos;
+
+	job->in = malloc(4 + (nbits + BZ_MAGIC_BITS + 32 + 7) / 8);
+	if (!job->in)
+		return -ENOMEM;
+
+	memcpy(job->in, "BZh9", 4);
+	w.p = (unsigned char *)job->in + 4;
+	w.acc = 0;
+	w.n = 0;
+
+	for (pos = job->start; pos + 32 <= job->end; pos += 32)
+		bz_put(&w, bz_bits(bz, pos, 32), 32);
+	if (pos < job->end)
+		bz_put(&w, bz_bits(bz, pos, job->end - pos), job->end - pos);
+	bz_put(&w, BZ_EOS_MAGIC, BZ_MAGIC_BITS);
+	bz_put(&w, job->block_crc, 32);
+	if (w.n)
+		bz_put(&w, 0, 8 - w.n);
+
+	memset(&job->strm, 0, sizeof(job->strm));
+	if (BZ2_bzDecompressInit(&job->strm, 0, 0) != BZ_OK)
+		return -ENOMEM;
+	job->strm_init = 1;
+
+	job->strm.next_in = job->in;
+	job->strm.avail_in = (char *)w.p - job->in;
+
+	return 0;
+}
+
+/* Decode next part of block, called without lock held */
+static int bz_job_run(struct t_decomp *dc, struct t_decomp_job *djob,
+		      unsigned char *buf, size_t size, size_t *len)
+{
+	struct t_bzip2 *bz = container_of(dc, struct t_bzip2, dc);
+	struct bz_job *job = container_of(djob, struct bz_job, job);
+	int ret;
+
+	if (!job->in) {
+		ret = bz_job_init(bz, job);
+		if (ret)
+			return ret;
+	}
+
+	job->strm.next_out = (char *)buf;
+	job->strm.avail_out = size;
+
+	while (job->strm.avail_out
+	       && !__atomic_load_n(&djob->cancel, __ATOMIC_RELAXED)) {
+		ret = BZ2_bzDecompress(&job->strm);
+		if (ret == BZ_STREAM_END) {
+			djob->finished = 1;
+			break;
+		}
+
+		/* Running out of input means block has been cut short */
+		if (ret != BZ_OK
+		    || (!job->strm.avail_in && job->strm.avail_out))
+			return -EIO;
+	}
+
+	*len = size - job->strm.avail_out;
+	job->len += *len;
+	if (djob->finished)
+		bz_job_reset(job);
+
+	return 0;
+}
+
+static struct bz_job *bz_new_job(struct t_bzip2 *bz, uint64_t start,
+				 uint64_t end, enum bz_mark end_mark)
+{
+	struct bz_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->start = start;
+	job->end = end;
+	job->end_mark = end_mark;
+	job->block_crc = bz_bits(bz, start + BZ_MAGIC_BITS, 32);
+
+	return job;
+}
+
+/* Queue block starting at next magic found, called with lock held */
+static int bz_schedule(struct t_decomp *dc)
+{
+	struct t_bzip2 *bz = container_of(dc, struct t_bzip2, dc);
+	struct bz_job *job;
+	enum bz_mark mark;
+	uint64_t pos;
+
+	t_readahead_map(bz->data, bz->size, bz->scan / 8, &dc->advised);
+
+	if (!bz->pending) {
+		pos = bz_find_mark(bz, bz->scan, &mark);
+		if (mark == BZ_MARK_END) {
+			dc->scan_done = 1;
+			return 0;
+		}
+		bz->pending = 1;
+		bz->pending_pos = pos;
+		bz->pending_mark = mark;
+		bz->scan = pos + 1;
+	}
+
+	/* Magics may overlap, so look right after the previous one */
+	pos = bz_find_mark(bz, bz->scan, &mark);
+
+	if (bz->pending_mark == BZ_MARK_BLOCK) {
+		job = bz_new_job(bz, bz->pending_pos, pos, mark);
+		if (!job)
+			return -ENOMEM;
+		t_decomp_queue(dc, &job->job);
+	}
+
+	if (mark == BZ_MARK_END) {
+		bz->pending = 0;
+		dc->scan_done = 1;
+		return 0;
+	}
+
+	bz->pending_pos = pos;
+	bz->pending_mark = mark;
+	bz->scan = pos + 1;
+
+	return 0;
+}
+
+/* Find first block of stream at given byte, skipping empty streams */
+static int bz_next_stream(struct t_decomp *dc, uint64_t off)
+{
+	struct t_bzip2 *bz = container_of(dc, struct t_bzip2, dc);
+	uint64_t pos, magic;
+
+	for (;;) {
+		/* Whatever follows the last stream is ignored, like bzip2 does */
+		if (off + 14 > bz->size || !bz_stream_header(bz->data + off)) {
+			dc->eof = 1;
+			return 0;
+		}
+
+		pos = off * 8 + 32;
+		magic = bz_bits(bz, pos, BZ_MAGIC_BITS);
+		if (magic == BZ_BLOCK_MAGIC) {
+			bz->expect = pos;
+			bz->stream_crc = 0;
+			return 0;
+		}
+
+		if (magic != BZ_EOS_MAGIC) {
+			dc->eof = 1;
+			return 0;
+		}
+
+		if (bz_bits(bz, pos + BZ_MAGIC_BITS, 32))
+			return -EIO;
+		off = (pos + BZ_MAGIC_BITS + 32 + 7) / 8;
+	}
+}
+
+/*
+ * Block failed to decode, maybe because it has been cut at magic which
+ * is a part of block data. Decode it once again up to the next magic.
+ */
+static int bz_merge_head(struct t_decomp *dc)
+{
+	struct t_bzip2 *bz = container_of(dc, struct t_bzip2, dc);
+	struct bz_job *job = container_of(dc->head, struct bz_job, job);
+	struct bz_job *next;
+	enum bz_mark mark;
+	uint64_t end;
+
+	if (job->end_mark == BZ_MARK_END || job->len)
+		return job->job.ret;
+
+	end = bz_find_mark(bz, job->end + 1, &mark);
+	if (end - job->start > BZ_MAX_BLOCK_BITS)
+		return job->job.ret;
+
+	while (job->job.next) {
+		next = container_of(job->job.next, struct bz_job, job);
+		if (next->start >= end)
+			break;
+		t_decomp_drop(dc, &job->job.next);
+	}
+
+	/* Don't let scanning start a job at the bogus magic */
+	if (bz->pending && bz->pending_pos < end) {
+		if (mark == BZ_MARK_END) {
+			bz->pending = 0;
+			dc->scan_done = 1;
+		} else {
+			bz->pending_pos = end;
+			bz->pending_mark = mark;
+			bz->scan = end + 1;
+		}
+	}
+
+	bz_job_reset(job);
+	job->end = end;
+	job->end_mark = mark;
+	t_decomp_requeue_head(dc);
+
+	return 0;
+}
+
+/* Head block is done, find out what should follow it */
+static int bz_advance(struct t_decomp *dc)
+{
+	struct t_bzip2 *bz = container_of(dc, struct t_bzip2, dc);
+	struct bz_job *job = container_of(dc->head, struct bz_job, job);
+	uint64_t end = job->end;
+	int ret;
+
+	if (job->job.ret)
+		return bz_merge_head(dc);
+
+	bz->stream_crc = (bz->stream_crc << 1 | bz->stream_crc >> 31)
+		^ job->block_crc;
+
+	if (job->end_mark == BZ_MARK_EOS) {
+		if (bz_bits(bz, end + BZ_MAGIC_BITS, 32) != bz->stream_crc)
+			return -EIO;
+		ret = bz_next_stream(dc, (end + BZ_MAGIC_BITS + 32 + 7) / 8);
+		if (ret)
+			return ret;
+	} else if (job->end_mark == BZ_MARK_BLOCK) {
+		bz->expect = end;
+	} else {
+		/* Stream has been cut short */
+		return -EIO;
+	}
+
+	t_decomp_drop(dc, &dc->head);
+	if (dc->eof)
+		return 0;
+
+	while (dc->head
+	       && container_of(dc->head, struct bz_job, job)->start != bz->expect)
+		t_decomp_drop(dc, &dc->head);
+
+	if (!dc->head) {
+		bz->scan = bz->expect;
+		bz->pending = 0;
+		dc->scan_done = 0;
+	}
+
+	return 0;
+}
+
+static void bz_release(struct t_decomp *dc)
+{
+	free(container_of(dc, struct t_bzip2, dc));
+}
+
+static const struct t_decomp_ops bz_ops = {
+	.schedule = bz_schedule,
+	.run = bz_job_run,
+	.advance = bz_advance,
+	.free_job = bz_free_job,
+	.release = bz_release,
+};
+
+struct t_decomp *t_bzip2_new(const void *data, size_t size, int threads)
+{
+	struct t_bzip2 *bz;
+
+	bz = calloc(1, sizeof(*bz));
+	if (!bz)
+		return NULL;
+
+	t_decomp_init(&bz->dc, &bz_ops, threads);
+	bz->data = data;
+	bz->size = size;
+	bz_init_tab(bz);
+
+	if (bz_next_stream(&bz->dc, 0)) {
+		t_decomp_free(&bz->dc);
+		return NULL;
+	}
+
+	return &bz->dc;
+}
@@ -0,0 +1,334 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compression of dumps while they are received.
+ *
+ * Data is cut into chunks which are compressed by a pool of threads, each
+ * into a frame of its own. Frames are written in order, one after another,
+ * which is a valid zstd or lz4 stream. The caller only copies data, unless
+ * all chunks are still being compressed.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zstd.h>
+#include <lz4frame.h>
+
+#include "thor_internal.h"
+
+#define T_COMPRESS_CHUNK_SIZE		(2*1024*1024)
+#define T_COMPRESS_MAX_THREADS		8
+/* Chunks being filled, compressed or written */
+#define T_COMPRESS_CHUNKS(cz)		(2 * (cz)->nthreads)
+
+enum t_compress_state {
+	T_COMPRESS_FREE = 0,
+	T_COMPRESS_QUEUED,
+	T_COMPRESS_RUNNING,
+	T_COMPRESS_DONE,
+};
+
+struct t_compress_chunk {
+	enum t_compress_state state;
+	unsigned char *in;
+	size_t in_len;
+	unsigned char *out;
+	size_t out_len;
+	int ret;
+};
+
+struct t_compress {
+	int format;
+	int level;
+	struct t_writer *wr;
+
+	pthread_t *threads;
+	int nthreads;
+	int nstarted;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int stop;
+
+	struct t_compress_chunk *chunks;
+	int nchunks;
+	size_t out_size;
+	/* Oldest chunk not written yet, and the one being filled */
+	int head;
+	int fill;
+	int err;
+};
+
+static int t_compress_chunk(struct t_compress *cz, ZSTD_CCtx **cctx,
+			    struct t_compress_chunk *chunk)
+{
+	LZ4F_preferences_t prefs;
+	size_t n;
+
+	if (cz->format == THOR_COMPRESS_LZ4) {
+		memset(&prefs, 0, sizeof(prefs));
+		prefs.compressionLevel = cz->level;
+		prefs.frameInfo.contentSize = chunk->in_len;
+		n = LZ4F_compressFrame(chunk->out, cz->out_size, chunk->in,
+				       chunk->in_len, &prefs);
+		if (LZ4F_isError(n))
+			return -EIO;
+	} else {
+		if (!*cctx)
+			*cctx = ZSTD_createCCtx();
+		if (!*cctx)
+			return -ENOMEM;
+		n = ZSTD_compressCCtx(*cctx, chunk->out, cz->out_size,
+				      chunk->in, chunk->in_len, cz->level);
+		if (ZSTD_isError(n))
+			return -EIO;
+	}
+
+	chunk->out_len = n;
+	return 0;
+}
+
+static void *t_compress_worker(void *arg)
+{
+	struct t_compress *cz = arg;
+	struct t_compress_chunk *chunk;
+	ZSTD_CCtx *cctx = NULL;
+	int i;
+	int ret;
+
+	pthread_mutex_lock(&cz->lock);
+	while (!cz->stop) {
+		/* Earlier chunks are written sooner */
+		chunk = NULL;
+		for (i = 0; i < cz->nchunks; ++i) {
+			chunk = &cz->chunks[(cz->head + i) % cz->nchunks];
+			if (chunk->state == T_COMPRESS_QUEUED)
+				break;
+			chunk = NULL;
+		}
+		if (!chunk) {
+			pthread_cond_wait(&cz->work, &cz->lock);
+			continue;
+		}
+
+		chunk->state = T_COMPRESS_RUNNING;
+		pthread_mutex_unlock(&cz->lock);
+
+		ret = t_compress_chunk(cz, &cctx, chunk);
+
+		pthread_mutex_lock(&cz->lock);
+		chunk->ret = ret;
+		chunk->state = T_COMPRESS_DONE;
+		pthread_cond_broadcast(&cz->done);
+	}
+	pthread_mutex_unlock(&cz->lock);
+
+	ZSTD_freeCCtx(cctx);
+	return NULL;
+}
+
+/*
+ * Compressed chunks are handed to writer in order. Waits for them only
+ * if all is set or if there is no free chunk to be filled next.
+ */
+static int t_compress_output(struct t_compress *cz, int all)
+{
+	struct t_compress_chunk *chunk;
+	int ret;
+
+	pthread_mutex_lock(&cz->lock);
+	for (;;) {
+		chunk = &cz->chunks[cz->head];
+		if (chunk->state == T_COMPRESS_FREE)
+			break;
+		if (chunk->state != T_COMPRESS_DONE) {
+			if (!all
+			    && cz->chunks[cz->fill].state == T_COMPRESS_FREE)
+				break;
+			pthread_cond_wait(&cz->done, &cz->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&cz->lock);
+
+		ret = chunk->ret;
+		if (!ret && !cz->err)
+			ret = t_writer_write(cz->wr, chunk->out,
+					     chunk->out_len);
+		if (ret && !cz->err)
+			cz->err = ret;
+
+		pthread_mutex_lock(&cz->lock);
+		chunk->state = T_COMPRESS_FREE;
+		chunk->in_len = 0;
+		cz->head = (cz->head + 1) % cz->nchunks;
+	}
+	pthread_mutex_unlock(&cz->lock);
+
+	return cz->err;
+}
+
+static void t_compress_push(struct t_compress *cz)
+{
+	pthread_mutex_lock(&cz->lock);
+	cz->chunks[cz->fill].state = T_COMPRESS_QUEUED;
+	cz->fill = (cz->fill + 1) % cz->nchunks;
+	pthread_cond_signal(&cz->work);
+	pthread_mutex_unlock(&cz->lock);
+}
+
+/* Data is copied, error of an earlier chunk is returned if there was one */
+int t_compress_write(struct t_compress *cz, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	struct t_compress_chunk *chunk;
+	size_t n;
+	int ret;
+
+	while (len) {
+		chunk = &cz->chunks[cz->fill];
+		n = T_COMPRESS_CHUNK_SIZE - chunk->in_len;
+		if (n > len)
+			n = len;
+		memcpy(chunk->in + chunk->in_len, p, n);
+		chunk->in_len += n;
+		p += n;
+		len -= n;
+
+		if (chunk->in_len == T_COMPRESS_CHUNK_SIZE) {
+			t_compress_push(cz);
+			ret = t_compress_output(cz, 0);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return cz->err;
+}
+
+/* Everything given so far is compressed and written when it returns */
+int t_compress_flush(struct t_compress *cz)
+{
+	int ret;
+
+	if (cz->chunks[cz->fill].in_len)
+		t_compress_push(cz);
+
+	ret = t_compress_output(cz, 1);
+	if (ret)
+		return ret;
+
+	return t_writer_flush(cz->wr);
+}
+
+/* Data not flushed is written before, writer is left to the caller */
+void t_compress_free(struct t_compress *cz)
+{
+	int i;
+
+	if (cz->nstarted)
+		t_compress_flush(cz);
+
+	pthread_mutex_lock(&cz->lock);
+	cz->stop = 1;
+	pthread_cond_broadcast(&cz->work);
+	pthread_mutex_unlock(&cz->lock);
+	for (i = 0; i < cz->nstarted; ++i)
+		pthread_join(cz->threads[i], NULL);
+
+	if (cz->chunks) {
+		for (i = 0; i < cz->nchunks; ++i) {
+			free(cz->chunks[i].in);
+			free(cz->chunks[i].out);
+		}
+	}
+	free(cz->chunks);
+	free(cz->threads);
+	pthread_cond_destroy(&cz->done);
+	pthread_cond_destroy(&cz->work);
+	pthread_mutex_destroy(&cz->lock);
+	free(cz);
+}
+
+/* Compressed data goes to wr, level 0 is the default of the format */
+int t_compress_new(struct t_writer *wr, int format, int level,
+		   struct t_compress **compress)
+{
+	LZ4F_preferences_t prefs;
+	struct t_compress *cz;
+	int i;
+
+	if (format != THOR_COMPRESS_ZSTD && format != THOR_COMPRESS_LZ4)
+		return -EINVAL;
+
+	cz = calloc(1, sizeof(*cz));
+	if (!cz)
+		return -ENOMEM;
+
+	cz->wr = wr;
+	cz->format = format;
+	cz->level = level;
+	pthread_mutex_init(&cz->lock, NULL);
+	pthread_cond_init(&cz->work, NULL);
+	pthread_cond_init(&cz->done, NULL);
+
+	cz->nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cz->nthreads < 1)
+		cz->nthreads = 1;
+	if (cz->nthreads > T_COMPRESS_MAX_THREADS)
+		cz->nthreads = T_COMPRESS_MAX_THREADS;
+
+	if (format == THOR_COMPRESS_LZ4) {
+		memset(&prefs, 0, sizeof(prefs));
+		prefs.frameInfo.contentSize = T_COMPRESS_CHUNK_SIZE;
+		cz->out_size = LZ4F_compressFrameBound(T_COMPRESS_CHUNK_SIZE,
+						       &prefs);
+	} else {
+		cz->out_size = ZSTD_compressBound(T_COMPRESS_CHUNK_SIZE);
+	}
+
+	cz->nchunks = T_COMPRESS_CHUNKS(cz);
+	cz->chunks = calloc(cz->nchunks, sizeof(*cz->chunks));
+	cz->threads = calloc(cz->nthreads, sizeof(*cz->threads));
+	if (!cz->chunks || !cz->threads)
+		goto err;
+
+	for (i = 0; i < cz->nchunks; ++i) {
+		cz->chunks[i].in = malloc(T_COMPRESS_CHUNK_SIZE);
+		cz->chunks[i].out = malloc(cz->out_size);
+		if (!cz->chunks[i].in || !cz->chunks[i].out)
+			goto err;
+	}
+
+	for (; cz->nstarted < cz->nthreads; ++cz->nstarted) {
+		if (pthread_create(&cz->threads[cz->nstarted], NULL,
+				   t_compress_worker, cz))
+			break;
+	}
+	if (!cz->nstarted)
+		goto err;
+
+	*compress = cz;
+	return 0;
+err:
+	t_compress_free(cz);
+	return -ENOMEM;
+}
@@ -0,0 +1,210 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * CRC-32 of gzip, computed with carry-less multiplication on x86 cpus
+ * and with crc instructions on arm64 cpus which have them. zlib is used
+ * for anything else.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "thor_internal.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define T_CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+#define T_CRC32_ARMV8
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32		(1 << 7)
+#endif
+#endif
+
+typedef uint32_t (*t_crc32_fn)(uint32_t crc, const unsigned char *buf,
+			       size_t len);
+
+static t_crc32_fn t_crc32_impl;
+static pthread_once_t t_crc32_once = PTHREAD_ONCE_INIT;
+
+static uint32_t t_crc32_zlib(uint32_t crc, const unsigned char *buf,
+			     size_t len)
+{
+	uInt n;
+
+	/* zlib takes 32 bit lengths */
+	while (len) {
+		n = len > (1U << 30) ? (1U << 30) : len;
+		crc = crc32(crc, buf, n);
+		buf += n;
+		len -= n;
+	}
+
+	return crc;
+}
+
+#ifdef T_CRC32_PCLMUL
+/*
+ * Folding of 64 byte blocks as described in "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" by Intel, with
+ * constants for the bit reflected gzip polynomial. Takes and returns crc
+ * which is not inverted, len has to be a multiple of 16, at least 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t t_crc32_fold(uint32_t crc, const unsigned char *buf,
+			     size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	len -= 64;
+
+	for (; len >= 64; buf += 64, len -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+			_mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+			_mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+			_mm_loadu_si128((const __m128i *)(buf + 0x30)));
+	}
+
+	/* Fold four lanes into one */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	for (; len >= 16; buf += 16, len -= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1,
+			_mm_loadu_si128((const __m128i *)buf)), x5);
+	}
+
+	/* Fold 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t t_crc32_pclmul(uint32_t crc, const unsigned char *buf,
+			       size_t len)
+{
+	size_t n = len & ~(size_t)15;
+
+	if (n >= 64) {
+		crc = ~t_crc32_fold(~crc, buf, n);
+		buf += n;
+		len -= n;
+	}
+
+	return t_crc32_zlib(crc, buf, len);
+}
+#endif /* T_CRC32_PCLMUL */
+
+#ifdef T_CRC32_ARMV8
+__attribute__((target("+crc")))
+static uint32_t t_crc32_armv8(uint32_t crc, const unsigned char *buf,
+			      size_t len)
+{
+	uint64_t v;
+
+	crc = ~crc;
+	for (; len && ((uintptr_t)buf & 7); --len)
+		crc = __crc32b(crc, *buf++);
+	for (; len >= 8; buf += 8, len -= 8) {
+		memcpy(&v, buf, sizeof(v));
+		crc = __crc32d(crc, v);
+	}
+	for (; len; --len)
+		crc = __crc32b(crc, *buf++);
+
+	return ~crc;
+}
+#endif /* T_CRC32_ARMV8 */
+
+static void t_crc32_select(void)
+{
+	t_crc32_impl = t_crc32_zlib;
+
+#ifdef T_CRC32_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul")
+	    && __builtin_cpu_supports("sse4.1"))
+		t_crc32_impl = t_crc32_pclmul;
+#endif
+#ifdef T_CRC32_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		t_crc32_impl = t_crc32_armv8;
+#endif
+}
+
+uint32_t t_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&t_crc32_once, t_crc32_select);
+
+	return t_crc32_impl(crc, buf, len);
+}
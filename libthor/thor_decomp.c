@@ -0,0 +1,353 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Common part of parallel decompressors.
+ *
+ * Compressed data is split into jobs by the format specific code, jobs are
+ * decompressed by a pool of threads and their output is handed over in
+ * order. Jobs may be just a guess, format code decides which of them are
+ * valid once the previous one is done and drops the rest.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "thor_internal.h"
+
+/* Slices a job may have ready before it has to wait for consumer */
+#define T_DECOMP_SLICES_AHEAD	4
+/* Jobs being decompressed or waiting to be read */
+#define T_DECOMP_JOBS_AHEAD(dc)	(2 * (dc)->nthreads)
+
+static double t_decomp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void t_decomp_free_job(struct t_decomp *dc, struct t_decomp_job *job)
+{
+	struct t_decomp_slice *slice;
+
+	while (job->slices) {
+		slice = job->slices;
+		job->slices = slice->next;
+		free(slice);
+	}
+
+	dc->ops->free_job(job);
+}
+
+void t_decomp_queue(struct t_decomp *dc, struct t_decomp_job *job)
+{
+	job->next = NULL;
+	job->state = T_DECOMP_JOB_QUEUED;
+	job->slices = NULL;
+	job->slices_tail = &job->slices;
+	job->nslices = 0;
+
+	*dc->tail = job;
+	dc->tail = &job->next;
+	++dc->njobs;
+
+	pthread_cond_broadcast(&dc->work);
+}
+
+/* Remove job from the queue, running one is freed by its thread */
+void t_decomp_drop(struct t_decomp *dc, struct t_decomp_job **link)
+{
+	struct t_decomp_job *job = *link;
+
+	*link = job->next;
+	if (!job->next)
+		dc->tail = link;
+	--dc->njobs;
+
+	if (job->state == T_DECOMP_JOB_RUNNING)
+		__atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+	else
+		t_decomp_free_job(dc, job);
+}
+
+/* Let finished head job run once more, e.g. with different input */
+void t_decomp_requeue_head(struct t_decomp *dc)
+{
+	struct t_decomp_job *job = dc->head;
+
+	job->state = T_DECOMP_JOB_QUEUED;
+	job->ret = 0;
+	job->finished = 0;
+	pthread_cond_broadcast(&dc->work);
+}
+
+static void *t_decomp_worker(void *arg)
+{
+	struct t_decomp_thread *thread = arg;
+	struct t_decomp *dc = thread->dc;
+	struct t_decomp_slice *slice;
+	struct t_decomp_job *job;
+	double start;
+	int i;
+	int ret;
+
+	pthread_mutex_lock(&dc->lock);
+	while (!dc->stop) {
+		/*
+		 * Earlier jobs are needed sooner, the ones too far ahead
+		 * would just hold memory
+		 */
+		for (job = dc->head, i = 0; job && i < T_DECOMP_JOBS_AHEAD(dc);
+		     job = job->next, ++i)
+			if (job->state == T_DECOMP_JOB_QUEUED)
+				break;
+
+		if (!job || i == T_DECOMP_JOBS_AHEAD(dc)) {
+			pthread_cond_wait(&dc->work, &dc->lock);
+			continue;
+		}
+
+		job->state = T_DECOMP_JOB_RUNNING;
+		pthread_mutex_unlock(&dc->lock);
+
+		start = t_decomp_now();
+		slice = malloc(sizeof(*slice) + T_DECOMP_SLICE);
+		if (slice) {
+			slice->next = NULL;
+			slice->len = 0;
+			ret = dc->ops->run(dc, job, slice->data, T_DECOMP_SLICE,
+					   &slice->len);
+		} else {
+			ret = -ENOMEM;
+		}
+
+		pthread_mutex_lock(&dc->lock);
+		thread->busy_time += t_decomp_now() - start;
+		if (slice)
+			thread->bytes += slice->len;
+
+		if (job->cancel) {
+			free(slice);
+			t_decomp_free_job(dc, job);
+			continue;
+		}
+
+		if (!ret && slice->len) {
+			*job->slices_tail = slice;
+			job->slices_tail = &slice->next;
+			++job->nslices;
+		} else {
+			free(slice);
+		}
+
+		if (ret || job->finished) {
+			job->ret = ret;
+			job->state = T_DECOMP_JOB_DONE;
+		} else if (job->nslices >= T_DECOMP_SLICES_AHEAD) {
+			job->state = T_DECOMP_JOB_PAUSED;
+		} else {
+			job->state = T_DECOMP_JOB_QUEUED;
+		}
+		pthread_cond_broadcast(&dc->done);
+	}
+	pthread_mutex_unlock(&dc->lock);
+
+	return NULL;
+}
+
+static int t_decomp_start_threads(struct t_decomp *dc)
+{
+	struct t_decomp_thread *thread;
+
+	dc->threads = calloc(dc->nthreads, sizeof(*dc->threads));
+	if (!dc->threads)
+		return -ENOMEM;
+
+	for (dc->nstarted = 0; dc->nstarted < dc->nthreads; ++dc->nstarted) {
+		thread = &dc->threads[dc->nstarted];
+		thread->dc = dc;
+		if (pthread_create(&thread->thread, NULL, t_decomp_worker,
+				   thread))
+			break;
+	}
+
+	return dc->nstarted ? 0 : -EAGAIN;
+}
+
+static int t_decomp_schedule(struct t_decomp *dc)
+{
+	int ret;
+
+	if (!dc->threads) {
+		ret = t_decomp_start_threads(dc);
+		if (ret)
+			return ret;
+	}
+
+	while (dc->njobs < T_DECOMP_JOBS_AHEAD(dc) && !dc->scan_done) {
+		ret = dc->ops->schedule(dc);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+ssize_t t_decomp_read(struct t_decomp *dc, const void **buf)
+{
+	struct t_decomp_slice *slice;
+	struct t_decomp_job *job;
+	ssize_t ret;
+
+	pthread_mutex_lock(&dc->lock);
+	free(dc->cur);
+	dc->cur = NULL;
+
+	while (!dc->err && !dc->eof) {
+		dc->err = t_decomp_schedule(dc);
+		if (dc->err || dc->eof)
+			break;
+
+		job = dc->head;
+		if (!job) {
+			dc->err = -EIO;
+			break;
+		}
+
+		if (job->slices) {
+			slice = job->slices;
+			job->slices = slice->next;
+			if (!job->slices)
+				job->slices_tail = &job->slices;
+			--job->nslices;
+
+			if (job->state == T_DECOMP_JOB_PAUSED) {
+				job->state = T_DECOMP_JOB_QUEUED;
+				pthread_cond_broadcast(&dc->work);
+			}
+
+			dc->cur = slice;
+			*buf = slice->data;
+			ret = slice->len;
+			pthread_mutex_unlock(&dc->lock);
+			return ret;
+		}
+
+		if (job->state != T_DECOMP_JOB_DONE) {
+			pthread_cond_wait(&dc->done, &dc->lock);
+			continue;
+		}
+
+		dc->err = dc->ops->advance(dc);
+	}
+
+	ret = dc->err;
+	pthread_mutex_unlock(&dc->lock);
+
+	return ret;
+}
+
+/*
+ * Advance for formats which know where each job starts, so that none of
+ * them has to be thrown away
+ */
+int t_decomp_advance_next(struct t_decomp *dc)
+{
+	if (dc->head->ret)
+		return dc->head->ret;
+
+	t_decomp_drop(dc, &dc->head);
+	if (!dc->head && dc->scan_done)
+		dc->eof = 1;
+
+	return 0;
+}
+
+/*
+ * Read through whatever follows the data consumed so far, if format needs
+ * to see it all, e.g. to keep an index
+ */
+int t_decomp_finish(struct t_decomp *dc)
+{
+	const void *buf;
+	ssize_t ret;
+
+	if (!dc->drain)
+		return 0;
+
+	while ((ret = t_decomp_read(dc, &buf)) > 0)
+		;
+
+	return ret;
+}
+
+void t_decomp_get_stats(struct t_decomp *dc,
+			struct thor_decompress_stats *stats)
+{
+	int i;
+
+	pthread_mutex_lock(&dc->lock);
+	stats->nthreads = dc->nstarted;
+	for (i = 0; i < dc->nstarted; ++i) {
+		stats->threads[i].bytes = dc->threads[i].bytes;
+		stats->threads[i].busy_time = dc->threads[i].busy_time;
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void t_decomp_init(struct t_decomp *dc, const struct t_decomp_ops *ops,
+		   int threads)
+{
+	memset(dc, 0, sizeof(*dc));
+	dc->ops = ops;
+	dc->nthreads = threads;
+	if (dc->nthreads > THOR_MAX_DECOMPRESS_THREADS)
+		dc->nthreads = THOR_MAX_DECOMPRESS_THREADS;
+	dc->tail = &dc->head;
+	pthread_mutex_init(&dc->lock, NULL);
+	pthread_cond_init(&dc->work, NULL);
+	pthread_cond_init(&dc->done, NULL);
+}
+
+void t_decomp_free(struct t_decomp *dc)
+{
+	int i;
+
+	pthread_mutex_lock(&dc->lock);
+	dc->stop = 1;
+	pthread_cond_broadcast(&dc->work);
+	pthread_mutex_unlock(&dc->lock);
+
+	for (i = 0; i < dc->nstarted; ++i)
+		pthread_join(dc->threads[i].thread, NULL);
+
+	while (dc->head)
+		t_decomp_drop(dc, &dc->head);
+
+	free(dc->cur);
+	free(dc->threads);
+	pthread_cond_destroy(&dc->done);
+	pthread_cond_destroy(&dc->work);
+	pthread_mutex_destroy(&dc->lock);
+
+	dc->ops->release(dc);
+}
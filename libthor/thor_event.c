@@ -0,0 +1,153 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "thor.h"
+#include "thor_internal.h"
+
+/*
+ * All devices use the default libusb context, so a single thread handles
+ * usb events for every handle which asked for it. It lives as long as
+ * there is at least one such handle.
+ */
+static pthread_mutex_t t_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t t_event_thread;
+static int t_event_users;
+static int t_event_stop;
+
+static void *t_event_thread_fn(void *arg)
+{
+	struct timeval tv;
+
+	while (!__atomic_load_n(&t_event_stop, __ATOMIC_ACQUIRE)) {
+		tv.tv_sec = T_USB_EVENT_TIMEOUT;
+		tv.tv_usec = 0;
+		libusb_handle_events_timeout_completed(NULL, &tv,
+						       &t_event_stop);
+	}
+
+	return NULL;
+}
+
+int t_thor_event_thread_get(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&t_event_lock);
+	if (!t_event_users) {
+		t_event_stop = 0;
+		ret = -pthread_create(&t_event_thread, NULL,
+				      t_event_thread_fn, NULL);
+	}
+	if (!ret)
+		++t_event_users;
+	pthread_mutex_unlock(&t_event_lock);
+
+	return ret;
+}
+
+void t_thor_event_thread_put(void)
+{
+	pthread_mutex_lock(&t_event_lock);
+	if (--t_event_users == 0) {
+		__atomic_store_n(&t_event_stop, 1, __ATOMIC_RELEASE);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(NULL);
+#endif
+		pthread_join(t_event_thread, NULL);
+	}
+	pthread_mutex_unlock(&t_event_lock);
+}
+
+void t_thor_cq_init(struct t_thor_cq *cq)
+{
+	cq->head = cq->tail = 0;
+	cq->waiting = cq->kicked = 0;
+	pthread_mutex_init(&cq->lock, NULL);
+	pthread_cond_init(&cq->cond, NULL);
+}
+
+void t_thor_cq_destroy(struct t_thor_cq *cq)
+{
+	pthread_cond_destroy(&cq->cond);
+	pthread_mutex_destroy(&cq->lock);
+}
+
+static void t_thor_cq_wake(struct t_thor_cq *cq)
+{
+	pthread_mutex_lock(&cq->lock);
+	pthread_cond_signal(&cq->cond);
+	pthread_mutex_unlock(&cq->lock);
+}
+
+/* Called only by producer, never blocks */
+int t_thor_cq_push(struct t_thor_cq *cq, struct t_thor_cq_entry *entry)
+{
+	unsigned int tail = cq->tail;
+
+	if (tail - __atomic_load_n(&cq->head, __ATOMIC_ACQUIRE)
+	    == T_THOR_CQ_SIZE)
+		return -ENOSPC;
+
+	cq->entries[tail % T_THOR_CQ_SIZE] = *entry;
+	__atomic_store_n(&cq->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	/* Take the lock only if consumer sleeps */
+	if (__atomic_load_n(&cq->waiting, __ATOMIC_SEQ_CST))
+		t_thor_cq_wake(cq);
+
+	return 0;
+}
+
+/* Called only by consumer, returns 1 if entry has been taken */
+int t_thor_cq_pop(struct t_thor_cq *cq, struct t_thor_cq_entry *entry)
+{
+	unsigned int head = cq->head;
+
+	if (head == __atomic_load_n(&cq->tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*entry = cq->entries[head % T_THOR_CQ_SIZE];
+	__atomic_store_n(&cq->head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* Wake up consumer even if there are no new entries */
+void t_thor_cq_kick(struct t_thor_cq *cq)
+{
+	pthread_mutex_lock(&cq->lock);
+	cq->kicked = 1;
+	pthread_cond_signal(&cq->cond);
+	pthread_mutex_unlock(&cq->lock);
+}
+
+void t_thor_cq_wait(struct t_thor_cq *cq)
+{
+	pthread_mutex_lock(&cq->lock);
+	__atomic_store_n(&cq->waiting, 1, __ATOMIC_SEQ_CST);
+	while (!cq->kicked
+	       && cq->head == __atomic_load_n(&cq->tail, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&cq->cond, &cq->lock);
+	__atomic_store_n(&cq->waiting, 0, __ATOMIC_SEQ_CST);
+	cq->kicked = 0;
+	pthread_mutex_unlock(&cq->lock);
+}
@@ -0,0 +1,800 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parallel decompression of gzip archives held in memory.
+ *
+ * Archive is split into segments which are inflated by a pool of threads
+ * and handed over in order. Segments start either at gzip members
+ * (bgzip, pigz -i, concatenated files) or at access points recorded while
+ * a big member has been inflated before. Member starts are found by
+ * looking for gzip magic, so some of them are just a guess. Segment is
+ * accepted only if the previous one ended exactly where it starts, the
+ * rest is thrown away and costs nothing but cpu time.
+ *
+ * Inflate backend is given raw deflate data only, header and trailer are
+ * handled here and CRC is computed by t_crc32(), which is faster than the
+ * one of zlib.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "thor_internal.h"
+
+/* Distance between access points in uncompressed data */
+#define GZ_SPAN			(4*1024*1024)
+#define GZ_WINDOW		32768
+/* Input fed to zlib at once, avail_in is only 32 bits wide */
+#define GZ_MAX_IN		(1U << 30)
+#define GZ_INDEX_MAGIC		"thor-gzi 1\n"
+
+#define GZ_FLG_HCRC		0x02
+#define GZ_FLG_EXTRA		0x04
+#define GZ_FLG_NAME		0x08
+#define GZ_FLG_COMMENT		0x10
+
+/*
+ * Raw deflate decoder with zlib interface. Backends keep their state in
+ * z_stream, the first registered one which is available is used.
+ */
+struct t_inflate_ops {
+	const char *name;
+	/* Optional, checks if cpu has what backend needs */
+	int (*available)(void);
+	int (*init)(z_streamp strm);
+	int (*prime)(z_streamp strm, int bits, int value);
+	int (*set_dict)(z_streamp strm, const Bytef *dict, uInt len);
+	int (*get_dict)(z_streamp strm, Bytef *dict, uInt *len);
+	int (*inflate)(z_streamp strm, int flush);
+	int (*end)(z_streamp strm);
+};
+
+static int gz_zlib_init(z_streamp strm)
+{
+	return inflateInit2(strm, -15);
+}
+
+static const struct t_inflate_ops gz_inflate_zlib = {
+	.name = "zlib",
+	.init = gz_zlib_init,
+	.prime = inflatePrime,
+	.set_dict = inflateSetDictionary,
+	.get_dict = inflateGetDictionary,
+	.inflate = inflate,
+	.end = inflateEnd,
+};
+
+static const struct t_inflate_ops *gz_inflate_backends[] = {
+	&gz_inflate_zlib,
+};
+
+static const struct t_inflate_ops *gz_inflate;
+static pthread_once_t gz_inflate_once = PTHREAD_ONCE_INIT;
+
+static void gz_inflate_select(void)
+{
+	const struct t_inflate_ops *ops;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(gz_inflate_backends); ++i) {
+		ops = gz_inflate_backends[i];
+		if (!ops->available || ops->available()) {
+			gz_inflate = ops;
+			return;
+		}
+	}
+}
+
+/* Place in deflate stream where inflate can be restarted */
+struct gz_point {
+	uint64_t in;		/* first full byte of input */
+	uint64_t out;		/* offset in member output */
+	int bits;		/* bits of input to take from byte before */
+	unsigned char *window;
+};
+
+struct gz_member {
+	uint64_t off;
+	uint64_t end;
+	int npoints;
+	struct gz_point *points;
+};
+
+struct gz_job {
+	struct t_decomp_job job;
+	/* Member where the segment belongs to */
+	uint64_t start;
+	/* Member split at access points, NULL if inflated as a whole */
+	struct gz_member *member;
+	/* Access point to start at, -1 for beginning of member */
+	int point;
+	/* Member output offset to stop at, UINT64_MAX for end of member */
+	uint64_t stop_out;
+
+	int member_end;
+	/* Input offset just after member trailer */
+	uint64_t end;
+
+	z_stream strm;
+	int strm_init;
+	uint64_t out;
+	/* Checksum and length of output of this segment */
+	uint32_t crc;
+	uint64_t len;
+	uint32_t trailer_crc;
+	uint32_t trailer_size;
+
+	/* Access points recorded on the way */
+	struct gz_point *rec;
+	int nrec;
+	uint64_t last_rec;
+};
+
+struct t_gzip {
+	struct t_decomp dc;
+	const unsigned char *data;
+	uint64_t size;
+	uint64_t scan;
+
+	/* What the next segment has to be */
+	uint64_t expect;
+	struct gz_member *expect_member;
+	int expect_point;
+	uint32_t member_crc;
+	uint64_t member_len;
+
+	struct gz_member *members;
+	int nmembers;
+	int record;
+	char *index_path;
+	void *key;
+	size_t key_len;
+};
+
+int t_gzip_probe(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	return size >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8
+		&& !(p[3] & 0xe0);
+}
+
+static void gz_free_members(struct gz_member *members, int nmembers)
+{
+	int i, j;
+
+	for (i = 0; i < nmembers; ++i) {
+		for (j = 0; j < members[i].npoints; ++j)
+			free(members[i].points[j].window);
+		free(members[i].points);
+	}
+	free(members);
+}
+
+static void gz_free_job(struct t_decomp_job *djob)
+{
+	struct gz_job *job = container_of(djob, struct gz_job, job);
+	int i;
+
+	if (job->strm_init)
+		gz_inflate->end(&job->strm);
+
+	for (i = 0; i < job->nrec; ++i)
+		free(job->rec[i].window);
+	free(job->rec);
+	free(job);
+}
+
+/* Find where deflate data of member starts */
+static int gz_skip_header(struct t_gzip *gz, uint64_t *pos)
+{
+	const unsigned char *p = gz->data + *pos;
+	const unsigned char *end = gz->data + gz->size;
+	const unsigned char *q = p + 10;
+	int flg = p[3];
+
+	if (flg & GZ_FLG_EXTRA) {
+		if (end - q < 2)
+			return -EIO;
+		q += 2 + (q[0] | q[1] << 8);
+	}
+
+	if (flg & GZ_FLG_NAME) {
+		q = q < end ? memchr(q, 0, end - q) : NULL;
+		if (!q)
+			return -EIO;
+		++q;
+	}
+
+	if (flg & GZ_FLG_COMMENT) {
+		q = q < end ? memchr(q, 0, end - q) : NULL;
+		if (!q)
+			return -EIO;
+		++q;
+	}
+
+	if (flg & GZ_FLG_HCRC)
+		q += 2;
+
+	if (q >= end)
+		return -EIO;
+
+	*pos += q - p;
+	return 0;
+}
+
+static int gz_job_init(struct t_gzip *gz, struct gz_job *job)
+{
+	struct gz_point *p;
+	uint64_t in = job->start;
+	int ret;
+
+	memset(&job->strm, 0, sizeof(job->strm));
+	ret = gz_inflate->init(&job->strm);
+	if (ret != Z_OK)
+		return -ENOMEM;
+	job->strm_init = 1;
+
+	if (job->point < 0) {
+		ret = gz_skip_header(gz, &in);
+		if (ret)
+			return ret;
+	} else {
+		p = &job->member->points[job->point];
+		if (p->bits)
+			gz_inflate->prime(&job->strm, p->bits,
+					  gz->data[p->in - 1] >> (8 - p->bits));
+		gz_inflate->set_dict(&job->strm, p->window, GZ_WINDOW);
+		job->out = p->out;
+		in = p->in;
+	}
+
+	job->strm.next_in = (unsigned char *)gz->data + in;
+	job->strm.avail_in = 0;
+	job->crc = 0;
+
+	return 0;
+}
+
+static int gz_record_point(struct t_gzip *gz, struct gz_job *job)
+{
+	struct gz_point *rec;
+	unsigned char *window;
+	uInt len = GZ_WINDOW;
+
+	window = malloc(GZ_WINDOW);
+	if (!window)
+		return -ENOMEM;
+
+	if (gz_inflate->get_dict(&job->strm, window, &len) != Z_OK
+	    || len != GZ_WINDOW) {
+		free(window);
+		return 0;
+	}
+
+	rec = realloc(job->rec, (job->nrec + 1) * sizeof(*rec));
+	if (!rec) {
+		free(window);
+		return -ENOMEM;
+	}
+
+	job->rec = rec;
+	rec += job->nrec++;
+	rec->in = job->strm.next_in - gz->data;
+	rec->out = job->out;
+	rec->bits = job->strm.data_type & 7;
+	rec->window = window;
+	job->last_rec = job->out;
+
+	return 0;
+}
+
+/* Read member trailer after raw deflate stream has ended */
+static int gz_read_trailer(struct t_gzip *gz, struct gz_job *job)
+{
+	uint64_t pos = job->strm.next_in - gz->data;
+	const unsigned char *t = gz->data + pos;
+
+	if (pos + 8 > gz->size)
+		return -EIO;
+
+	job->trailer_crc = t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24;
+	job->trailer_size = t[4] | t[5] << 8 | t[6] << 16 | (uint32_t)t[7] << 24;
+	job->end = pos + 8;
+
+	return 0;
+}
+
+/* Inflate next part of segment, called without lock held */
+static int gz_job_run(struct t_decomp *dc, struct t_decomp_job *djob,
+		      unsigned char *buf, size_t size, size_t *len)
+{
+	struct t_gzip *gz = container_of(dc, struct t_gzip, dc);
+	struct gz_job *job = container_of(djob, struct gz_job, job);
+	int record = gz->record && !job->member;
+	int flush = record ? Z_BLOCK : Z_NO_FLUSH;
+	uint64_t want = size;
+	uint64_t pos;
+	unsigned char *prev;
+	int ret;
+
+	if (!job->strm_init) {
+		ret = gz_job_init(gz, job);
+		if (ret)
+			return ret;
+	}
+
+	if (job->stop_out != UINT64_MAX && job->stop_out - job->out < want)
+		want = job->stop_out - job->out;
+
+	job->strm.next_out = buf;
+	job->strm.avail_out = want;
+
+	while (job->strm.avail_out
+	       && !__atomic_load_n(&djob->cancel, __ATOMIC_RELAXED)) {
+		if (!job->strm.avail_in) {
+			pos = job->strm.next_in - gz->data;
+			if (pos >= gz->size)
+				return -EIO;
+			job->strm.avail_in = gz->size - pos < GZ_MAX_IN ?
+				gz->size - pos : GZ_MAX_IN;
+		}
+
+		prev = job->strm.next_out;
+		ret = gz_inflate->inflate(&job->strm, flush);
+		job->out += job->strm.next_out - prev;
+
+		job->crc = t_crc32(job->crc, prev, job->strm.next_out - prev);
+
+		if (ret == Z_STREAM_END) {
+			job->member_end = 1;
+			ret = gz_read_trailer(gz, job);
+			if (ret)
+				return ret;
+			break;
+		}
+
+		if (ret != Z_OK && !(ret == Z_BUF_ERROR && !job->strm.avail_in))
+			return -EIO;
+
+		if (record && (job->strm.data_type & 128)
+		    && !(job->strm.data_type & 64)
+		    && job->out - job->last_rec >= GZ_SPAN) {
+			ret = gz_record_point(gz, job);
+			if (ret)
+				return ret;
+		}
+	}
+
+	*len = want - job->strm.avail_out;
+	job->len += *len;
+	if (job->member_end || job->out == job->stop_out) {
+		djob->finished = 1;
+		gz_inflate->end(&job->strm);
+		job->strm_init = 0;
+	}
+
+	return 0;
+}
+
+static struct gz_job *gz_new_job(uint64_t start, struct gz_member *member,
+				 int point)
+{
+	struct gz_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->start = start;
+	job->member = member;
+	job->point = point;
+	job->stop_out = UINT64_MAX;
+	if (member && point + 1 < member->npoints)
+		job->stop_out = member->points[point + 1].out;
+
+	return job;
+}
+
+static struct gz_member *gz_find_member(struct t_gzip *gz, uint64_t off)
+{
+	int lo = 0, hi = gz->nmembers;
+	int mid;
+
+	if (gz->record)
+		return NULL;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (gz->members[mid].off == off)
+			return &gz->members[mid];
+		if (gz->members[mid].off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+static uint64_t gz_find_candidate(struct t_gzip *gz, uint64_t from)
+{
+	const unsigned char *p;
+
+	while (from < gz->size) {
+		p = memchr(gz->data + from, 0x1f, gz->size - from);
+		if (!p)
+			break;
+
+		from = p - gz->data;
+		if (t_gzip_probe(p, gz->size - from))
+			return from;
+		++from;
+	}
+
+	return UINT64_MAX;
+}
+
+/* Queue segments of next member start found, called with lock held */
+static int gz_schedule(struct t_decomp *dc)
+{
+	struct t_gzip *gz = container_of(dc, struct t_gzip, dc);
+	struct gz_member *member;
+	struct gz_job *job;
+	uint64_t start;
+	int i;
+
+	t_readahead_map(gz->data, gz->size, gz->scan, &dc->advised);
+
+	start = gz_find_candidate(gz, gz->scan);
+	if (start == UINT64_MAX) {
+		dc->scan_done = 1;
+		return 0;
+	}
+
+	member = gz_find_member(gz, start);
+	for (i = -1; i < (member ? member->npoints : 0); ++i) {
+		job = gz_new_job(start, member, i);
+		if (!job)
+			return -ENOMEM;
+		t_decomp_queue(dc, &job->job);
+	}
+
+	/* Access points tell where the member ends */
+	gz->scan = member ? member->end : start + 1;
+
+	return 0;
+}
+
+static int gz_job_matches(struct t_gzip *gz, struct t_decomp_job *djob)
+{
+	struct gz_job *job = container_of(djob, struct gz_job, job);
+
+	if (gz->expect_point < 0)
+		return job->point < 0 && job->start == gz->expect;
+
+	return job->member == gz->expect_member
+		&& job->point == gz->expect_point;
+}
+
+/* Keep access points of a member which has been inflated as a whole */
+static int gz_keep_points(struct t_gzip *gz, struct gz_job *job)
+{
+	struct gz_member *members;
+
+	members = realloc(gz->members,
+			  (gz->nmembers + 1) * sizeof(*members));
+	if (!members)
+		return -ENOMEM;
+
+	gz->members = members;
+	members += gz->nmembers++;
+	members->off = job->start;
+	members->end = job->end;
+	members->npoints = job->nrec;
+	members->points = job->rec;
+	job->rec = NULL;
+	job->nrec = 0;
+
+	return 0;
+}
+
+/* Head segment is done, find out what should follow it */
+static int gz_advance(struct t_decomp *dc)
+{
+	struct t_gzip *gz = container_of(dc, struct t_gzip, dc);
+	struct gz_job *job = container_of(dc->head, struct gz_job, job);
+	int ret;
+
+	if (job->job.ret)
+		return job->job.ret;
+
+	if (job->point < 0) {
+		gz->member_crc = job->crc;
+		gz->member_len = job->len;
+	} else {
+		gz->member_crc = crc32_combine(gz->member_crc, job->crc,
+					       job->len);
+		gz->member_len += job->len;
+	}
+
+	if (job->member_end) {
+		if (gz->member_crc != job->trailer_crc
+		    || (uint32_t)gz->member_len != job->trailer_size)
+			return -EIO;
+
+		if (gz->record && job->nrec) {
+			ret = gz_keep_points(gz, job);
+			if (ret)
+				return ret;
+		}
+
+		gz->expect = job->end;
+		gz->expect_member = NULL;
+		gz->expect_point = -1;
+	} else {
+		gz->expect_member = job->member;
+		gz->expect_point = job->point + 1;
+	}
+
+	t_decomp_drop(dc, &dc->head);
+
+	while (dc->head && !gz_job_matches(gz, dc->head))
+		t_decomp_drop(dc, &dc->head);
+
+	if (!dc->head && gz->expect_point < 0) {
+		/* Whatever follows the last member is ignored, like gzip does */
+		if (gz->scan > gz->expect || !t_gzip_probe(gz->data + gz->expect,
+						gz->size - gz->expect)) {
+			dc->eof = 1;
+			return 0;
+		}
+		gz->scan = gz->expect;
+		dc->scan_done = 0;
+	}
+
+	return 0;
+}
+
+static void gz_release(struct t_decomp *dc);
+
+static const struct t_decomp_ops gz_ops = {
+	.schedule = gz_schedule,
+	.run = gz_job_run,
+	.advance = gz_advance,
+	.free_job = gz_free_job,
+	.release = gz_release,
+};
+
+struct t_decomp *t_gzip_new(const void *data, size_t size, int threads)
+{
+	struct t_gzip *gz;
+
+	pthread_once(&gz_inflate_once, gz_inflate_select);
+
+	gz = calloc(1, sizeof(*gz));
+	if (!gz)
+		return NULL;
+
+	t_decomp_init(&gz->dc, &gz_ops, threads);
+	gz->data = data;
+	gz->size = size;
+	gz->expect_point = -1;
+
+	return &gz->dc;
+}
+
+static int gz_load_index(struct t_gzip *gz, FILE *f)
+{
+	char magic[sizeof(GZ_INDEX_MAGIC)];
+	struct gz_member *m;
+	struct gz_point *p;
+	uint64_t hdr[3];
+	void *key;
+	int ret = -EINVAL;
+	int nmembers;
+	int i, j;
+
+	key = malloc(gz->key_len);
+	if (!key)
+		return -ENOMEM;
+
+	if (fread(magic, 1, sizeof(magic) - 1, f) != sizeof(magic) - 1
+	    || memcmp(magic, GZ_INDEX_MAGIC, sizeof(magic) - 1)
+	    || fread(key, 1, gz->key_len, f) != gz->key_len
+	    || memcmp(key, gz->key, gz->key_len)
+	    || fread(&nmembers, sizeof(nmembers), 1, f) != 1
+	    || nmembers <= 0 || nmembers > gz->size / 18)
+		goto free_key;
+
+	gz->members = calloc(nmembers, sizeof(*gz->members));
+	if (!gz->members) {
+		ret = -ENOMEM;
+		goto free_key;
+	}
+
+	for (i = 0; i < nmembers; ++i) {
+		m = &gz->members[i];
+		if (fread(hdr, sizeof(hdr), 1, f) != 1 || !hdr[2]
+		    || hdr[0] >= hdr[1] || hdr[1] > gz->size
+		    || hdr[2] > gz->size / 8
+		    || (i && hdr[0] < gz->members[i - 1].end))
+			goto free_members;
+
+		m->off = hdr[0];
+		m->end = hdr[1];
+		m->points = calloc(hdr[2], sizeof(*m->points));
+		if (!m->points) {
+			ret = -ENOMEM;
+			goto free_members;
+		}
+		++gz->nmembers;
+
+		for (j = 0; j < (int)hdr[2]; ++j) {
+			p = &m->points[j];
+			p->window = malloc(GZ_WINDOW);
+			if (!p->window) {
+				ret = -ENOMEM;
+				goto free_members;
+			}
+			++m->npoints;
+
+			if (fread(&p->in, sizeof(p->in), 1, f) != 1
+			    || fread(&p->out, sizeof(p->out), 1, f) != 1
+			    || fread(&p->bits, sizeof(p->bits), 1, f) != 1
+			    || fread(p->window, GZ_WINDOW, 1, f) != 1
+			    || p->in <= m->off || p->in >= m->end
+			    || p->bits < 0 || p->bits > 7
+			    || (j && (p->in <= m->points[j - 1].in
+				      || p->out <= m->points[j - 1].out)))
+				goto free_members;
+		}
+	}
+
+	free(key);
+	return 0;
+
+free_members:
+	gz_free_members(gz->members, gz->nmembers);
+	gz->members = NULL;
+	gz->nmembers = 0;
+free_key:
+	free(key);
+	return ret;
+}
+
+static int gz_save_index(struct t_gzip *gz)
+{
+	struct gz_member *m;
+	struct gz_point *p;
+	uint64_t hdr[3];
+	char *tmp;
+	FILE *f;
+	mode_t mask;
+	int fd;
+	int i, j;
+	int ret = 0;
+
+	tmp = malloc(strlen(gz->index_path) + sizeof(".XXXXXX"));
+	if (!tmp)
+		return -ENOMEM;
+	sprintf(tmp, "%s.XXXXXX", gz->index_path);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = -errno;
+		goto free_tmp;
+	}
+
+	/* Other users of the archive should be able to use it too */
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		ret = -errno;
+		close(fd);
+		goto unlink_tmp;
+	}
+
+	fwrite(GZ_INDEX_MAGIC, 1, sizeof(GZ_INDEX_MAGIC) - 1, f);
+	fwrite(gz->key, 1, gz->key_len, f);
+	fwrite(&gz->nmembers, sizeof(gz->nmembers), 1, f);
+	for (i = 0; i < gz->nmembers; ++i) {
+		m = &gz->members[i];
+		hdr[0] = m->off;
+		hdr[1] = m->end;
+		hdr[2] = m->npoints;
+		fwrite(hdr, sizeof(hdr), 1, f);
+		for (j = 0; j < m->npoints; ++j) {
+			p = &m->points[j];
+			fwrite(&p->in, sizeof(p->in), 1, f);
+			fwrite(&p->out, sizeof(p->out), 1, f);
+			fwrite(&p->bits, sizeof(p->bits), 1, f);
+			fwrite(p->window, GZ_WINDOW, 1, f);
+		}
+	}
+
+	if (ferror(f) | fclose(f)) {
+		ret = -EIO;
+		goto unlink_tmp;
+	}
+
+	if (!rename(tmp, gz->index_path))
+		goto free_tmp;
+
+	ret = -errno;
+unlink_tmp:
+	unlink(tmp);
+free_tmp:
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Use access points stored in given file if it has been written for the
+ * same key, otherwise record them and store when whole archive has been
+ * read. Points are kept in host byte order, the file isn't portable.
+ */
+int t_gzip_use_index(struct t_decomp *dc, const char *path,
+		     const void *key, size_t key_len)
+{
+	struct t_gzip *gz = container_of(dc, struct t_gzip, dc);
+	FILE *f;
+
+	gz->index_path = strdup(path);
+	gz->key = malloc(key_len);
+	if (!gz->index_path || !gz->key)
+		return -ENOMEM;
+
+	memcpy(gz->key, key, key_len);
+	gz->key_len = key_len;
+
+	f = fopen(path, "r");
+	if (f) {
+		gz_load_index(gz, f);
+		fclose(f);
+	}
+
+	gz->record = !gz->nmembers;
+	/* Points of the last member are known only once it is read */
+	dc->drain = gz->record;
+
+	return 0;
+}
+
+static void gz_release(struct t_decomp *dc)
+{
+	struct t_gzip *gz = container_of(dc, struct t_gzip, dc);
+
+	if (gz->record && dc->eof && gz->nmembers)
+		gz_save_index(gz);
+
+	gz_free_members(gz->members, gz->nmembers);
+	free(gz->index_path);
+	free(gz->key);
+	free(gz);
+}
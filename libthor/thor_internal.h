@@ -17,6 +17,8 @@
 #ifndef THOR_INTERNAL_H__
 #define THOR_INTERNAL_H__
 
+#include <time.h>
+#include <pthread.h>
 #include <libusb-1.0/libusb.h>
 
 #include "thor.h"
@@ -24,6 +26,9 @@
 #include "odin-proto.h"
 
 #define DEFAULT_TIMEOUT 4000 /* 4000 ms */
+#define T_USB_EVENT_TIMEOUT 1 /* 1 s, single wait for usb events */
+#define T_USB_AUTO_SUB_TRANSFER_SIZE (256*1024)
+#define T_USB_SUB_TRANSFERS_PER_LIMIT 64
 
 #ifndef offsetof
 #define offsetof(type, member) ((size_t) &((type *)0)->member)
@@ -35,6 +40,21 @@
 
 #define ARRAY_SIZE(_a) (sizeof(_a)/sizeof(_a[0]))
 
+struct t_thor_data_chunk;
+struct t_prefetch_buf;
+
+/* Chunks and buffers reused for all files sent through a handle */
+struct t_thor_arena {
+	struct t_thor_data_chunk *chunks;
+	int nchunks;
+	struct t_prefetch_buf *bufs;
+	off_t buf_size;
+	int n_dev_mem;
+	int n_heap;
+};
+
+#define T_THOR_ARENA_BUFS	(2*THOR_MAX_QUEUE_DEPTH)
+
 struct thor_device_handle {
 	libusb_device_handle *devh;
 	int control_interface;
@@ -43,7 +63,16 @@ struct thor_device_handle {
 	int data_interface_id;
 	int data_ep_in;
 	int data_ep_out;
+	int data_ep_out_mps;
 	int odin_mode;
+	int queue_depth;
+	int adaptive_depth;
+	int prefetch;
+	int event_thread;
+	off_t sub_transfer_size;
+	off_t auto_sub_transfer_size;
+	struct t_thor_arena arena;
+	struct thor_stats stats;
 };
 
 struct t_usb_transfer;
@@ -53,22 +82,108 @@ typedef void (*t_usb_transfer_cb)(struct t_usb_transfer *);
 struct t_usb_transfer {
 	struct libusb_transfer *ltransfer;
 	t_usb_transfer_cb transfer_finished;
+	void *user_data;
 	off_t size;
 	int ret;
 	int cancelled;
 };
 
+enum t_prefetch_buf_state {
+	T_PREFETCH_BUF_FREE = 0,
+	T_PREFETCH_BUF_FILLED,
+	T_PREFETCH_BUF_BUSY,
+	T_PREFETCH_BUF_RELEASE,
+};
+
+struct t_prefetch_buf {
+	unsigned char *buf;
+	/* Either buf or memory borrowed from data source */
+	unsigned char *data;
+	off_t size;
+	int borrowed;
+	int dev_mem;
+	enum t_prefetch_buf_state state;
+};
+
+#define T_THOR_CQ_SIZE	256
+
+struct t_thor_cq_entry {
+	off_t data_sent;
+	off_t data_left;
+	int chunk_number;
+};
+
+/*
+ * Single producer (event thread), single consumer (sending thread) ring.
+ * Mutex and condition are used only to sleep when there is nothing to do.
+ */
+struct t_thor_cq {
+	struct t_thor_cq_entry entries[T_THOR_CQ_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	int waiting;
+	int kicked;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct t_prefetch {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct thor_device_handle *th;
+	struct thor_data_src *data;
+	struct t_prefetch_buf *bufs;
+	int nbufs;
+	int head;
+	int tail;
+	int used;
+	int limit;
+	off_t buf_size;
+	off_t to_read;
+	int running;
+	int stop;
+	int ret;
+	/* Kicked when a buffer is ready after t_prefetch_try_get() failed */
+	struct t_thor_cq *cq;
+	int waiting;
+	/* Data read before restart, served before data source */
+	unsigned char *prefix;
+	off_t prefix_len;
+	off_t prefix_off;
+	/*
+	 * Once allowed, next entry of data source is opened as soon as
+	 * current one has been read. Result is kept until it's taken.
+	 */
+	int may_advance;
+	int entry_ready;
+	int entry_ret;
+};
+
+/* Upper limit, sub-transfers get bigger if unit would need more */
+#define T_THOR_MAX_SUB_TRANSFERS	32
+
 struct t_thor_data_chunk {
-	struct t_usb_transfer data_transfer;
+	/* Transfer unit is sent as nsubs consecutive bulk transfers */
+	struct t_usb_transfer data_transfers[T_THOR_MAX_SUB_TRANSFERS];
+	int nsubs;
+	int subs_init;
+	int subs_pending;
 	struct t_usb_transfer resp_transfer;
 	void *user_data;
 	off_t useful_size;
 	struct data_res_pkt resp;
 	unsigned char *buf;
+	unsigned char *own_buf;
+	int own_buf_dev_mem;
+	int borrowed;
+	struct t_prefetch_buf *pbuf;
 	off_t trans_unit_size;
 	int chunk_number;
 	int data_finished;
 	int resp_finished;
+	int busy;
+	struct timespec submit_time;
 };
 
 struct t_thor_data_transfer {
@@ -76,16 +191,35 @@ struct t_thor_data_transfer {
 	struct thor_data_src *data;
 	thor_progress_cb report_progress;
 	void *user_data;
+	off_t trans_unit_size;
+	off_t sub_transfer_size;
 	off_t data_left;
 	off_t data_sent;
 	off_t data_in_progress;
 	int chunk_number;
 	int completed;
+	int cancelling;
 	int ret;
+	struct t_prefetch *prefetch;
+	int prefetch_ahead;
+	int chunks_in_flight;
+	int queue_depth;
+	int adaptive;
+	double lat_avg;
+	double lat_min;
+	double lat_min_prev;
+	int lat_samples;
+	/* Used only if callbacks run in event thread */
+	int event_thread;
+	int starved;
+	off_t data_reported;
+	pthread_mutex_t lock;
+	struct t_thor_cq cq;
 };
 
 
-int t_usb_handle_events_completed(int *completed);
+int t_usb_handle_events_completed(struct thor_device_handle *th,
+				  int *completed);
 
 int t_usb_init_transfer(struct t_usb_transfer *t,
 			libusb_device_handle *devh,
@@ -119,6 +253,14 @@ static inline int t_usb_init_out_transfer(struct t_usb_transfer *t,
 				   transfer_finished, timeout);
 }
 
+static inline void t_usb_set_transfer_buffer(struct t_usb_transfer *t,
+					     unsigned char *buf, off_t size)
+{
+	t->ltransfer->buffer = buf;
+	t->ltransfer->length = size;
+	t->size = size;
+}
+
 static inline int t_usb_submit_transfer(struct t_usb_transfer *t)
 {
 	return libusb_submit_transfer(t->ltransfer);
@@ -129,11 +271,312 @@ static inline int t_usb_cancel_transfer(struct t_usb_transfer *t)
 	return libusb_cancel_transfer(t->ltransfer);
 }
 
-int t_file_get_data_src(const char *path, struct thor_data_src **data);
+int t_prefetch_start(struct t_prefetch *pf, struct thor_device_handle *th,
+		     struct thor_data_src *data, off_t size, off_t buf_size,
+		     int nbufs, int limit, unsigned char *prefix,
+		     off_t prefix_len);
+
+void t_prefetch_advance(struct t_prefetch *pf);
+
+int t_prefetch_next_entry(struct t_prefetch *pf);
+
+void t_prefetch_set_cq(struct t_prefetch *pf, struct t_thor_cq *cq);
+
+int t_prefetch_get(struct t_prefetch *pf, struct t_prefetch_buf **pbuf);
+
+int t_prefetch_try_get(struct t_prefetch *pf, struct t_prefetch_buf **pbuf);
+
+void t_prefetch_put(struct t_prefetch *pf, struct t_prefetch_buf *pbuf);
+
+void t_prefetch_set_limit(struct t_prefetch *pf, int limit);
+
+int t_prefetch_stop(struct t_prefetch *pf, unsigned char **leftover,
+		    off_t *leftover_len);
+
+void t_thor_cq_init(struct t_thor_cq *cq);
+
+void t_thor_cq_destroy(struct t_thor_cq *cq);
+
+int t_thor_cq_push(struct t_thor_cq *cq, struct t_thor_cq_entry *entry);
+
+int t_thor_cq_pop(struct t_thor_cq *cq, struct t_thor_cq_entry *entry);
+
+void t_thor_cq_kick(struct t_thor_cq *cq);
+
+void t_thor_cq_wait(struct t_thor_cq *cq);
+
+int t_thor_event_thread_get(void);
+
+void t_thor_event_thread_put(void);
+
+/* Allocates a buffer of arena->buf_size, device memory if possible */
+unsigned char *t_thor_arena_alloc(struct t_thor_arena *arena,
+				  struct thor_device_handle *th, int *dev_mem);
+
+/* Output of parallel decompression handed over at once */
+#define T_DECOMP_SLICE	(1024*1024)
+
+enum t_decomp_job_state {
+	T_DECOMP_JOB_QUEUED = 0,
+	T_DECOMP_JOB_RUNNING,
+	T_DECOMP_JOB_PAUSED,	/* Enough output waits to be read */
+	T_DECOMP_JOB_DONE,
+};
+
+struct t_decomp_slice {
+	struct t_decomp_slice *next;
+	size_t len;
+	unsigned char data[];
+};
+
+/* Embedded in format specific job */
+struct t_decomp_job {
+	struct t_decomp_job *next;
+	enum t_decomp_job_state state;
+	int cancel;
+	int ret;
+	/* Set by run() after the last part of output */
+	int finished;
+	struct t_decomp_slice *slices;
+	struct t_decomp_slice **slices_tail;
+	int nslices;
+};
+
+struct t_decomp;
+
+struct t_decomp_ops {
+	/*
+	 * Queue next job(s), set scan_done if there are no more, or eof if
+	 * there is nothing left to read at all
+	 */
+	int (*schedule)(struct t_decomp *dc);
+	/* Decompress next part of job into buf, called without lock held */
+	int (*run)(struct t_decomp *dc, struct t_decomp_job *job,
+		   unsigned char *buf, size_t size, size_t *len);
+	/*
+	 * Head job is done and its output has been read. Drop it and any
+	 * following jobs which turned out to be wrong, or set eof.
+	 */
+	int (*advance)(struct t_decomp *dc);
+	void (*free_job)(struct t_decomp_job *job);
+	void (*release)(struct t_decomp *dc);
+};
+
+struct t_decomp_thread {
+	pthread_t thread;
+	struct t_decomp *dc;
+	unsigned long long bytes;
+	double busy_time;
+};
+
+/* Embedded in format specific decompressor */
+struct t_decomp {
+	const struct t_decomp_ops *ops;
+	int nthreads;
+	int nstarted;
+	struct t_decomp_thread *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int stop;
+
+	/* Jobs in order of their output */
+	struct t_decomp_job *head;
+	struct t_decomp_job **tail;
+	int njobs;
+	int scan_done;
+
+	int eof;
+	int err;
+	struct t_decomp_slice *cur;
+	/* Read all data in t_decomp_finish() */
+	int drain;
+	/* End of input asked to be read ahead */
+	size_t advised;
+};
+
+void t_decomp_init(struct t_decomp *dc, const struct t_decomp_ops *ops,
+		   int threads);
+
+/* Used by format code from its ops, with dc->lock held */
+void t_decomp_queue(struct t_decomp *dc, struct t_decomp_job *job);
+
+void t_decomp_drop(struct t_decomp *dc, struct t_decomp_job **link);
+
+void t_decomp_requeue_head(struct t_decomp *dc);
+
+int t_decomp_advance_next(struct t_decomp *dc);
+
+/* Get next block of decompressed data, 0 at the end */
+ssize_t t_decomp_read(struct t_decomp *dc, const void **buf);
+
+/* Called once the archive has been read */
+int t_decomp_finish(struct t_decomp *dc);
+
+void t_decomp_get_stats(struct t_decomp *dc,
+			struct thor_decompress_stats *stats);
+
+void t_decomp_free(struct t_decomp *dc);
+
+/* Input ahead of current position asked to be read in advance */
+#define T_READAHEAD_WINDOW	(16*1024*1024)
+
+void t_readahead_map(const void *addr, size_t size, size_t pos,
+		     size_t *advised);
+
+void t_readahead_fd(int fd, off_t pos, off_t *advised);
+
+/* Page cache use of a file which is sent as it is */
+struct t_cache {
+	int fd;
+	void *map;
+	off_t size;
+	/* Bytes read ahead of what is being read, 0 leaves it to the kernel */
+	off_t window;
+	off_t advised;
+	/* Pages are dropped once they have been sent */
+	int drop;
+	off_t drop_start;
+	off_t done_end;
+};
+
+/* Map may be NULL, fd has to stay open while cache is used */
+void t_cache_init(struct t_cache *cache, int fd, void *map, off_t size,
+		  const struct thor_data_src_opts *opts);
+
+/* Data at off is about to be read */
+void t_cache_read(struct t_cache *cache, off_t off, off_t len);
+
+/* Data at off has been sent and won't be needed again */
+void t_cache_done(struct t_cache *cache, off_t off, off_t len);
+
+void t_cache_flush(struct t_cache *cache);
+
+struct t_reader;
+
+/* Read fd with a thread of its own, fd is closed at the end if own_fd */
+struct t_reader *t_reader_new(int fd, int own_fd);
+
+/* Get next block of data, 0 at the end */
+ssize_t t_reader_read(struct t_reader *rd, const void **buf);
+
+off_t t_reader_skip(struct t_reader *rd, off_t len);
+
+int t_reader_seekable(struct t_reader *rd);
+
+void t_reader_free(struct t_reader *rd);
+
+struct t_uring;
+
+/* -ENOSYS if kernel can't do reads and writes through io_uring */
+int t_uring_new(unsigned int entries, struct t_uring **ring);
+
+/* Queued read, or write if write is set, is started by next submit */
+int t_uring_queue(struct t_uring *ring, int write, int fd, void *buf,
+		  size_t len, off_t off, uint64_t user_data);
+
+int t_uring_submit(struct t_uring *ring);
+
+/* Wait for next completion, res is what read or write would return */
+int t_uring_wait(struct t_uring *ring, uint64_t *user_data, int *res);
+
+void t_uring_free(struct t_uring *ring);
+
+struct t_writer;
+
+/* Write fd from off on behind the caller, through io_uring if use_uring */
+struct t_writer *t_writer_new(int fd, off_t off, int use_uring);
+
+/* Data is copied, error of an earlier write is returned if there was one */
+int t_writer_write(struct t_writer *wr, const void *data, size_t len);
+
+/* Wait until everything is written */
+int t_writer_flush(struct t_writer *wr);
+
+void t_writer_free(struct t_writer *wr);
+
+struct t_compress;
+
+/* Compress with THOR_COMPRESS_* format in parallel, output goes to wr */
+int t_compress_new(struct t_writer *wr, int format, int level,
+		   struct t_compress **compress);
+
+/* Data is copied, error of an earlier chunk is returned if there was one */
+int t_compress_write(struct t_compress *cz, const void *data, size_t len);
+
+/* Compress and write everything, writer is flushed as well */
+int t_compress_flush(struct t_compress *cz);
+
+void t_compress_free(struct t_compress *cz);
+
+/* CRC-32 as used by gzip, initial value is 0 */
+uint32_t t_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* Check if data starts with gzip header */
+int t_gzip_probe(const void *data, size_t size);
+
+/* Prepare parallel decompression of gzip data held in memory */
+struct t_decomp *t_gzip_new(const void *data, size_t size, int threads);
+
+int t_gzip_use_index(struct t_decomp *dc, const char *path,
+		     const void *key, size_t key_len);
+
+/* Check if data starts with bzip2 stream header */
+int t_bzip2_probe(const void *data, size_t size);
+
+/* Prepare parallel decompression of bzip2 data held in memory */
+struct t_decomp *t_bzip2_new(const void *data, size_t size, int threads);
+
+int t_zstd_probe(const void *data, size_t size);
+
+/* Frames of zstd data are decompressed in parallel */
+struct t_decomp *t_zstd_new(const void *data, size_t size, int threads);
+
+int t_xz_probe(const void *data, size_t size);
+
+/* Blocks of xz data are decompressed in parallel */
+struct t_decomp *t_xz_new(const void *data, size_t size, int threads);
+
+int t_lz4_probe(const void *data, size_t size);
+
+/* Frames of lz4 data are decompressed in parallel */
+struct t_decomp *t_lz4_new(const void *data, size_t size, int threads);
+
+/* Android sparse image header, as much of it as is needed to probe it */
+#define T_SPARSE_HEADER_LEN	28
+
+struct t_sparse;
+
+/* Reads next part of the sparse image, returns 0 at the end */
+typedef off_t (*t_sparse_read_fn)(void *arg, void *buf, off_t len);
+
+/* Size of expanded image, 0 if hdr doesn't start a sparse image */
+off_t t_sparse_probe(const void *hdr, size_t len);
+
+int t_sparse_new(const void *hdr, t_sparse_read_fn read, void *arg,
+		 struct t_sparse **sparse);
+
+/* Expanded image, fill and don't care chunks are not read from anywhere */
+off_t t_sparse_read(struct t_sparse *sp, void *buf, off_t len);
+
+void t_sparse_free(struct t_sparse *sp);
+
+int t_file_get_data_src(const char *path, struct thor_data_src_opts *opts,
+			struct thor_data_src **data);
+
+int t_file_get_data_dest(const char *path, struct thor_data_src_opts *opts,
+			 struct thor_data_src **data);
+
+int t_tar_get_data_src(const char *path, struct thor_data_src_opts *opts,
+		       struct thor_data_src **data);
+
+off_t t_usb_get_auto_sub_transfer_size(struct thor_device_handle *th);
 
-int t_file_get_data_dest(const char *path, struct thor_data_src **data);
+unsigned char *t_usb_alloc_buffer(struct thor_device_handle *th, off_t size,
+				  int *dev_mem);
 
-int t_tar_get_data_src(const char *path, struct thor_data_src **data);
+void t_usb_free_buffer(struct thor_device_handle *th, unsigned char *buf,
+		       off_t size, int dev_mem);
 
 int t_usb_send(struct thor_device_handle *th, unsigned char *buf,
 	       off_t count, int timeout);
@@ -0,0 +1,207 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parallel decompression of lz4 archives held in memory.
+ *
+ * Frame size is found by walking through block sizes, each frame is a job
+ * of its own. Archives which are concatenated lz4 files split into many
+ * frames, lz4 tool makes just one, which is still decompressed
+ * in background.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <lz4frame.h>
+
+#include "thor_internal.h"
+
+#define LZ4_FLG_BLOCK_CHECKSUM		0x10
+#define LZ4_FLG_CONTENT_CHECKSUM	0x04
+#define LZ4_BLOCK_UNCOMPRESSED		0x80000000U
+
+struct lz_job {
+	struct t_decomp_job job;
+	const unsigned char *in;
+	size_t in_size;
+	LZ4F_dctx *dctx;
+};
+
+struct t_lz4 {
+	struct t_decomp dc;
+	const unsigned char *data;
+	size_t size;
+	size_t scan;
+};
+
+static uint32_t lz_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+int t_lz4_probe(const void *data, size_t size)
+{
+	return size >= 7 && lz_le32(data) == LZ4F_MAGICNUMBER;
+}
+
+static void lz_free_job(struct t_decomp_job *djob)
+{
+	struct lz_job *job = container_of(djob, struct lz_job, job);
+
+	LZ4F_freeDecompressionContext(job->dctx);
+	free(job);
+}
+
+/* Decompress next part of frame, called without lock held */
+static int lz_job_run(struct t_decomp *dc, struct t_decomp_job *djob,
+		      unsigned char *buf, size_t size, size_t *len)
+{
+	struct lz_job *job = container_of(djob, struct lz_job, job);
+	size_t in_len, out_len;
+	size_t ret;
+
+	if (!job->dctx
+	    && LZ4F_isError(LZ4F_createDecompressionContext(&job->dctx,
+							     LZ4F_VERSION)))
+		return -ENOMEM;
+
+	*len = 0;
+	while (*len < size) {
+		in_len = job->in_size;
+		out_len = size - *len;
+		ret = LZ4F_decompress(job->dctx, buf + *len, &out_len,
+				      job->in, &in_len, NULL);
+		if (LZ4F_isError(ret))
+			return -EIO;
+
+		job->in += in_len;
+		job->in_size -= in_len;
+		*len += out_len;
+
+		if (!ret) {
+			djob->finished = 1;
+			LZ4F_freeDecompressionContext(job->dctx);
+			job->dctx = NULL;
+			break;
+		}
+
+		/* Frame size has been checked, so this is a corrupted one */
+		if (!job->in_size && *len < size)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/* Get size of frame from its header and block sizes, 0 if it's broken */
+static size_t lz_frame_size(const unsigned char *p, size_t size)
+{
+	size_t pos;
+	uint32_t magic = lz_le32(p);
+	uint32_t bsize;
+
+	if ((magic & 0xfffffff0) == LZ4F_MAGIC_SKIPPABLE_START) {
+		pos = 8 + (size_t)lz_le32(p + 4);
+		return pos <= size ? pos : 0;
+	}
+
+	if (magic != LZ4F_MAGICNUMBER)
+		return 0;
+
+	pos = LZ4F_headerSize(p, size);
+	if (LZ4F_isError(pos))
+		return 0;
+
+	for (;;) {
+		if (pos + 4 > size)
+			return 0;
+		bsize = lz_le32(p + pos) & ~LZ4_BLOCK_UNCOMPRESSED;
+		pos += 4;
+		if (!bsize)
+			break;
+
+		pos += bsize;
+		if (p[4] & LZ4_FLG_BLOCK_CHECKSUM)
+			pos += 4;
+	}
+
+	if (p[4] & LZ4_FLG_CONTENT_CHECKSUM)
+		pos += 4;
+
+	return pos <= size ? pos : 0;
+}
+
+/* Queue next frame, called with lock held */
+static int lz_schedule(struct t_decomp *dc)
+{
+	struct t_lz4 *lz = container_of(dc, struct t_lz4, dc);
+	struct lz_job *job;
+	size_t len;
+
+	t_readahead_map(lz->data, lz->size, lz->scan, &dc->advised);
+
+	if (lz->size - lz->scan < 8)
+		return -EIO;
+
+	len = lz_frame_size(lz->data + lz->scan, lz->size - lz->scan);
+	if (!len)
+		return -EIO;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
+	job->in = lz->data + lz->scan;
+	job->in_size = len;
+	t_decomp_queue(dc, &job->job);
+
+	lz->scan += len;
+	if (lz->scan == lz->size)
+		dc->scan_done = 1;
+
+	return 0;
+}
+
+static void lz_release(struct t_decomp *dc)
+{
+	free(container_of(dc, struct t_lz4, dc));
+}
+
+static const struct t_decomp_ops lz_ops = {
+	.schedule = lz_schedule,
+	.run = lz_job_run,
+	.advance = t_decomp_advance_next,
+	.free_job = lz_free_job,
+	.release = lz_release,
+};
+
+struct t_decomp *t_lz4_new(const void *data, size_t size, int threads)
+{
+	struct t_lz4 *lz;
+
+	lz = calloc(1, sizeof(*lz));
+	if (!lz)
+		return NULL;
+
+	t_decomp_init(&lz->dc, &lz_ops, threads);
+	lz->data = data;
+	lz->size = size;
+
+	return &lz->dc;
+}
@@ -0,0 +1,426 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "thor.h"
+#include "thor_internal.h"
+
+/*
+ * Reading from data source (especially decompressing an archive) may take
+ * a while so we do this in a separate thread and fill a ring of buffers
+ * ahead of the usb side. Completion callbacks only swap in a buffer which
+ * is ready and resubmit the transfer.
+ *
+ * The thread lives for the whole thor_send_data() call. When it's done
+ * with an entry it opens the next one and starts reading it, so the data
+ * is ready while control requests of previous entry are still exchanged.
+ *
+ * Full transfer units are borrowed from the data source if it allows so,
+ * those are given back from this thread once the usb side is done with
+ * them, so the data source is never accessed from two threads.
+ */
+static void t_prefetch_release_borrowed(struct t_prefetch *pf)
+{
+	struct t_prefetch_buf *pbuf;
+	int i;
+
+	for (i = 0; i < pf->nbufs; ++i) {
+		pbuf = pf->bufs + i;
+		if (pbuf->state != T_PREFETCH_BUF_RELEASE)
+			continue;
+
+		if (pf->data->release_block)
+			pf->data->release_block(pf->data, pbuf->data,
+						pbuf->size);
+		pbuf->borrowed = 0;
+		pbuf->state = T_PREFETCH_BUF_FREE;
+		--pf->used;
+	}
+}
+
+/* Called with lock held */
+static void t_prefetch_notify(struct t_prefetch *pf)
+{
+	if (pf->cq && pf->waiting) {
+		pf->waiting = 0;
+		t_thor_cq_kick(pf->cq);
+	}
+}
+
+static off_t t_prefetch_fill(struct t_prefetch *pf,
+			     struct t_prefetch_buf *pbuf, off_t len)
+{
+	off_t from_prefix = 0;
+	void *data;
+	off_t ret;
+
+	if (pf->data->borrow_block && len == pf->buf_size
+	    && pf->prefix_off == pf->prefix_len) {
+		ret = pf->data->borrow_block(pf->data, &data, len);
+		if (ret < 0)
+			return ret;
+
+		if (ret) {
+			pbuf->data = data;
+			pbuf->borrowed = 1;
+			return ret;
+		}
+	}
+
+	if (!pbuf->buf) {
+		pbuf->buf = t_thor_arena_alloc(&pf->th->arena, pf->th,
+					       &pbuf->dev_mem);
+		if (!pbuf->buf)
+			return -ENOMEM;
+	}
+
+	if (pf->prefix_off < pf->prefix_len) {
+		from_prefix = pf->prefix_len - pf->prefix_off;
+		if (from_prefix > len)
+			from_prefix = len;
+		memcpy(pbuf->buf, pf->prefix + pf->prefix_off, from_prefix);
+		pf->prefix_off += from_prefix;
+	}
+
+	ret = from_prefix;
+	if (len > from_prefix) {
+		ret = pf->data->get_block(pf->data, pbuf->buf + from_prefix,
+					  len - from_prefix);
+		if (ret >= 0)
+			ret += from_prefix;
+	}
+
+	if (ret == len)
+		memset(pbuf->buf + len, 0, pf->buf_size - len);
+
+	pbuf->data = pbuf->buf;
+	return ret;
+}
+
+/* Called with lock held, opens next entry of data source */
+static int t_prefetch_next_file(struct t_prefetch *pf)
+{
+	int ret;
+
+	pf->may_advance = 0;
+	pthread_mutex_unlock(&pf->lock);
+
+	ret = pf->data->next_file(pf->data);
+
+	pthread_mutex_lock(&pf->lock);
+	pf->entry_ret = ret;
+	pf->entry_ready = 1;
+	if (ret > 0)
+		pf->to_read = pf->data->get_file_length(pf->data);
+	pthread_cond_broadcast(&pf->cond);
+
+	return ret;
+}
+
+static void *t_prefetch_thread(void *arg)
+{
+	struct t_prefetch *pf = arg;
+	struct t_prefetch_buf *pbuf;
+	off_t len;
+	off_t ret;
+
+	pthread_mutex_lock(&pf->lock);
+	while (!pf->stop) {
+		t_prefetch_release_borrowed(pf);
+
+		if (pf->to_read == 0) {
+			if (pf->may_advance) {
+				if (t_prefetch_next_file(pf) <= 0)
+					break;
+				continue;
+			}
+
+			pthread_cond_wait(&pf->cond, &pf->lock);
+			continue;
+		}
+
+		pbuf = pf->bufs + pf->tail;
+		if (pbuf->state != T_PREFETCH_BUF_FREE || pf->used >= pf->limit) {
+			pthread_cond_wait(&pf->cond, &pf->lock);
+			continue;
+		}
+
+		len = pf->to_read > pf->buf_size ? pf->buf_size : pf->to_read;
+		pthread_mutex_unlock(&pf->lock);
+
+		ret = t_prefetch_fill(pf, pbuf, len);
+
+		pthread_mutex_lock(&pf->lock);
+		if (ret != len) {
+			pf->ret = ret < 0 ? ret : -EIO;
+			pthread_cond_broadcast(&pf->cond);
+			break;
+		}
+
+		pbuf->size = len;
+		pbuf->state = T_PREFETCH_BUF_FILLED;
+		pf->to_read -= len;
+		pf->tail = (pf->tail + 1) % pf->nbufs;
+		++pf->used;
+		pthread_cond_broadcast(&pf->cond);
+		t_prefetch_notify(pf);
+	}
+	t_prefetch_notify(pf);
+	pthread_mutex_unlock(&pf->lock);
+
+	return NULL;
+}
+
+/*
+ * Start reading current entry of data source, size bytes are left in it.
+ * Prefix, if given, is taken over and served before the data source.
+ */
+int t_prefetch_start(struct t_prefetch *pf, struct thor_device_handle *th,
+		     struct thor_data_src *data, off_t size, off_t buf_size,
+		     int nbufs, int limit, unsigned char *prefix,
+		     off_t prefix_len)
+{
+	int i;
+	int ret;
+
+	memset(pf, 0, sizeof(*pf));
+	/* Buffers are owned by the arena and survive between files */
+	pf->th = th;
+	pf->bufs = th->arena.bufs;
+	for (i = 0; i < nbufs; ++i) {
+		pf->bufs[i].state = T_PREFETCH_BUF_FREE;
+		pf->bufs[i].size = 0;
+		pf->bufs[i].borrowed = 0;
+	}
+
+	pf->data = data;
+	pf->nbufs = nbufs;
+	pf->limit = limit;
+	pf->buf_size = buf_size;
+	pf->to_read = size;
+	pf->prefix = prefix;
+	pf->prefix_len = prefix_len;
+
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+
+	ret = pthread_create(&pf->thread, NULL, t_prefetch_thread, pf);
+	if (ret) {
+		pthread_cond_destroy(&pf->cond);
+		pthread_mutex_destroy(&pf->lock);
+		free(prefix);
+		pf->prefix = NULL;
+		return -ret;
+	}
+
+	pf->running = 1;
+	return 0;
+}
+
+/* Let the thread open next entry once it's done with current one */
+void t_prefetch_advance(struct t_prefetch *pf)
+{
+	pthread_mutex_lock(&pf->lock);
+	pf->may_advance = 1;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+/* Returns what data->next_file() returned for the next entry */
+int t_prefetch_next_entry(struct t_prefetch *pf)
+{
+	int ret;
+
+	pthread_mutex_lock(&pf->lock);
+	while (!pf->entry_ready && !pf->ret)
+		pthread_cond_wait(&pf->cond, &pf->lock);
+
+	if (pf->entry_ready) {
+		pf->entry_ready = 0;
+		ret = pf->entry_ret;
+	} else {
+		ret = pf->ret;
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return ret;
+}
+
+void t_prefetch_set_cq(struct t_prefetch *pf, struct t_thor_cq *cq)
+{
+	pthread_mutex_lock(&pf->lock);
+	pf->cq = cq;
+	pf->waiting = 0;
+	pthread_mutex_unlock(&pf->lock);
+}
+
+int t_prefetch_get(struct t_prefetch *pf, struct t_prefetch_buf **pbuf)
+{
+	struct t_prefetch_buf *head;
+	int ret = 0;
+
+	pthread_mutex_lock(&pf->lock);
+	head = pf->bufs + pf->head;
+	while (head->state != T_PREFETCH_BUF_FILLED && !pf->ret)
+		pthread_cond_wait(&pf->cond, &pf->lock);
+
+	if (head->state == T_PREFETCH_BUF_FILLED) {
+		head->state = T_PREFETCH_BUF_BUSY;
+		pf->head = (pf->head + 1) % pf->nbufs;
+		*pbuf = head;
+	} else {
+		ret = pf->ret;
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return ret;
+}
+
+/*
+ * Same as above but doesn't wait, returns -EAGAIN if no buffer is ready.
+ * Prefetch thread kicks the completion queue when one gets ready.
+ */
+int t_prefetch_try_get(struct t_prefetch *pf, struct t_prefetch_buf **pbuf)
+{
+	struct t_prefetch_buf *head;
+	int ret = 0;
+
+	pthread_mutex_lock(&pf->lock);
+	head = pf->bufs + pf->head;
+	if (head->state == T_PREFETCH_BUF_FILLED) {
+		head->state = T_PREFETCH_BUF_BUSY;
+		pf->head = (pf->head + 1) % pf->nbufs;
+		*pbuf = head;
+	} else if (pf->ret) {
+		ret = pf->ret;
+	} else {
+		pf->waiting = 1;
+		ret = -EAGAIN;
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return ret;
+}
+
+void t_prefetch_put(struct t_prefetch *pf, struct t_prefetch_buf *pbuf)
+{
+	pthread_mutex_lock(&pf->lock);
+	if (pbuf->borrowed) {
+		/* Given back to data source by prefetch thread */
+		pbuf->state = T_PREFETCH_BUF_RELEASE;
+	} else {
+		pbuf->state = T_PREFETCH_BUF_FREE;
+		--pf->used;
+	}
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+void t_prefetch_set_limit(struct t_prefetch *pf, int limit)
+{
+	if (limit > pf->nbufs)
+		limit = pf->nbufs;
+
+	pthread_mutex_lock(&pf->lock);
+	pf->limit = limit;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+/* Copy out data which has been read but not taken yet */
+static int t_prefetch_save_leftover(struct t_prefetch *pf,
+				    unsigned char **leftover,
+				    off_t *leftover_len)
+{
+	struct t_prefetch_buf *pbuf;
+	off_t len = pf->prefix_len - pf->prefix_off;
+	unsigned char *buf;
+	int i;
+
+	for (i = 0; i < pf->nbufs; ++i)
+		if (pf->bufs[i].state == T_PREFETCH_BUF_FILLED)
+			len += pf->bufs[i].size;
+
+	*leftover = NULL;
+	*leftover_len = len;
+	if (!len)
+		return 0;
+
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+
+	/* Filled buffers are in order starting from head */
+	len = 0;
+	for (i = 0; i < pf->nbufs; ++i) {
+		pbuf = pf->bufs + (pf->head + i) % pf->nbufs;
+		if (pbuf->state != T_PREFETCH_BUF_FILLED)
+			break;
+		memcpy(buf + len, pbuf->data, pbuf->size);
+		len += pbuf->size;
+	}
+
+	memcpy(buf + len, pf->prefix + pf->prefix_off,
+	       pf->prefix_len - pf->prefix_off);
+
+	*leftover = buf;
+	return 0;
+}
+
+/*
+ * Stop the thread. If leftover is given, data read ahead is returned
+ * there, so the thread may be started again e.g. with other buffer size.
+ */
+int t_prefetch_stop(struct t_prefetch *pf, unsigned char **leftover,
+		    off_t *leftover_len)
+{
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&pf->lock);
+	pf->stop = 1;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+
+	pthread_join(pf->thread, NULL);
+
+	if (leftover) {
+		ret = pf->ret;
+		if (!ret)
+			ret = t_prefetch_save_leftover(pf, leftover,
+						       leftover_len);
+	}
+
+	/* All buffers are back so nothing may stay borrowed */
+	for (i = 0; i < pf->nbufs; ++i)
+		if (pf->bufs[i].borrowed)
+			pf->bufs[i].state = T_PREFETCH_BUF_RELEASE;
+	t_prefetch_release_borrowed(pf);
+
+	free(pf->prefix);
+	pf->prefix = NULL;
+	pf->running = 0;
+
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->lock);
+
+	return ret;
+}
@@ -14,24 +14,69 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE	/* O_DIRECT */
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
 #include <libgen.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
 
 #include "thor.h"
 #include "thor_internal.h"
 
+/* Reads with O_DIRECT go through an aligned buffer unless they are aligned */
+#define FILE_DIRECT_ALIGN	4096
+#define FILE_DIRECT_BUF_SIZE	(1024*1024)
+
+/* Reads kept in flight ahead of the sender */
+#define FILE_URING_SLOTS	4
+#define FILE_URING_SLOT_SIZE	(1024*1024)
+
+struct file_uring_slot {
+	unsigned char *data;
+	off_t off;
+	/* Bytes asked for and bytes read so far */
+	off_t want;
+	off_t len;
+	int busy;
+	int err;
+};
+
 struct file_data_src {
 	struct thor_data_src src;
 	int fd;
 	const char *filename;
 	int pos;
+	/* Whole file mapped for zero-copy reads, NULL if not possible */
+	unsigned char *map;
+	off_t map_size;
+	off_t offset;
+	/* Android sparse image expanded while it is read, NULL otherwise */
+	struct t_sparse *sparse;
+	struct t_cache cache;
+	/* File is read with O_DIRECT, bypassing page cache */
+	int direct;
+	unsigned char *dbuf;
+	off_t dbuf_off;
+	off_t dbuf_len;
+	/* Unmapped images are read through io_uring if kernel has it */
+	struct t_uring *ring;
+	struct file_uring_slot slots[FILE_URING_SLOTS];
+	/* Slot being read */
+	int head;
+	/* Where next slot is queued, or next block of dump is written */
+	off_t next_off;
+	/* Size of image, or of dump once it is known */
+	off_t file_size;
+	/* Dumps are written behind the receiver, compressed if asked to */
+	struct t_writer *writer;
+	struct t_compress *compress;
 	struct thor_data_src_entry entry;
 	struct thor_data_src_entry *ent[2];
 };
@@ -50,6 +95,24 @@ static off_t file_get_file_length(struct thor_data_src *src)
 	return buf.st_size;
 }
 
+/* Size of data to be sent, sparse images are counted as expanded */
+static off_t file_get_src_length(struct thor_data_src *src)
+{
+	struct file_data_src *filedata =
+		container_of(src, struct file_data_src, src);
+
+	return filedata->entry.size;
+}
+
+/* Compressed dump is as long as the data it will hold */
+static off_t file_get_dump_length(struct thor_data_src *src)
+{
+	struct file_data_src *filedata =
+		container_of(src, struct file_data_src, src);
+
+	return filedata->file_size;
+}
+
 static int file_set_file_length(struct thor_data_src *src,
 				off_t len)
 {
@@ -57,11 +120,84 @@ static int file_set_file_length(struct thor_data_src *src,
 	struct file_data_src *filedata =
 		container_of(src, struct file_data_src, src);
 
+	/* Size of compressed output isn't known */
+	if (filedata->compress) {
+		filedata->file_size = len;
+		return 0;
+	}
+
+	/* Blocks are reserved up front, so the dump doesn't fail half way */
+	if (len && fallocate(filedata->fd, 0, 0, len) < 0
+	    && errno != EOPNOTSUPP && errno != ENOSYS)
+		return -errno;
+
 	ret = ftruncate(filedata->fd, len);
 	if (ret < 0) {
 		return -errno;
 	}
 
+	filedata->file_size = len;
+	return 0;
+}
+
+static int file_uring_queue(struct file_data_src *filedata, int i)
+{
+	struct file_uring_slot *slot = &filedata->slots[i];
+	int ret;
+
+	ret = t_uring_queue(filedata->ring, 0, filedata->fd,
+			    slot->data + slot->len, slot->want - slot->len,
+			    slot->off + slot->len, i);
+	if (ret)
+		return ret;
+
+	slot->busy = 1;
+	/* Whatever isn't taken now is submitted on next wait */
+	t_uring_submit(filedata->ring);
+	return 0;
+}
+
+/* Wait for a read to complete, short ones are queued again */
+static int file_uring_complete(struct file_data_src *filedata)
+{
+	struct file_uring_slot *slot;
+	uint64_t i;
+	int res;
+	int ret;
+
+	ret = t_uring_wait(filedata->ring, &i, &res);
+	if (ret)
+		return ret;
+
+	slot = &filedata->slots[i];
+	slot->busy = 0;
+	if (res < 0) {
+		slot->err = res;
+		return 0;
+	}
+
+	slot->len += res;
+	/* Reads come back short at the end of file */
+	if (res && slot->len < slot->want
+	    && slot->off + slot->len < filedata->file_size)
+		return file_uring_queue(filedata, i);
+
+	return 0;
+}
+
+static int file_uring_drain(struct file_data_src *filedata)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < FILE_URING_SLOTS; ++i) {
+		while (filedata->slots[i].busy) {
+			ret = file_uring_complete(filedata);
+			if (ret)
+				return ret;
+		}
+	}
+
 	return 0;
 }
 
@@ -72,6 +208,37 @@ static off_t file_put_data_block(struct thor_data_src *src,
 	struct file_data_src *filedata =
 		container_of(src, struct file_data_src, src);
 
+	if (filedata->compress) {
+		ret = t_compress_write(filedata->compress, data, len);
+		if (ret)
+			return ret;
+		filedata->next_off += len;
+
+		if (filedata->file_size
+		    && filedata->next_off >= filedata->file_size) {
+			ret = t_compress_flush(filedata->compress);
+			if (ret)
+				return ret;
+		}
+		return len;
+	}
+
+	if (filedata->writer) {
+		ret = t_writer_write(filedata->writer, data, len);
+		if (ret)
+			return ret;
+		filedata->next_off += len;
+
+		/* Last block isn't done until it's on disk */
+		if (filedata->file_size
+		    && filedata->next_off >= filedata->file_size) {
+			ret = t_writer_flush(filedata->writer);
+			if (ret)
+				return ret;
+		}
+		return len;
+	}
+
 	ret = write(filedata->fd, data, len);
 	if (ret < 0) {
 		ret = -errno;
@@ -79,18 +246,366 @@ static off_t file_put_data_block(struct thor_data_src *src,
 	return ret;
 }
 
+/* Filesystem refused O_DIRECT reads, carry on with buffered ones */
+static void file_direct_off(struct file_data_src *filedata)
+{
+	int flags = fcntl(filedata->fd, F_GETFL);
+
+	fcntl(filedata->fd, F_SETFL, flags & ~O_DIRECT);
+	lseek(filedata->fd, filedata->offset, SEEK_SET);
+	filedata->direct = 0;
+}
+
+static off_t file_pread_direct(struct file_data_src *filedata, void *buf,
+			       off_t len, off_t off)
+{
+	ssize_t ret;
+
+	do {
+		ret = pread(filedata->fd, buf, len, off);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+/*
+ * Aligned parts of aligned buffers are read in place, anything else, like
+ * the tail of the image, through the aligned buffer
+ */
+static off_t file_read_direct(struct file_data_src *filedata,
+			      void *data, off_t len)
+{
+	unsigned char *buf = data;
+	off_t pos = filedata->offset;
+	off_t dbuf_end = filedata->dbuf_off + filedata->dbuf_len;
+	off_t done = 0;
+	off_t n;
+
+	while (done < len) {
+		if (pos >= filedata->dbuf_off && pos < dbuf_end) {
+			n = dbuf_end - pos;
+			if (n > len - done)
+				n = len - done;
+			memcpy(buf + done,
+			       filedata->dbuf + (pos - filedata->dbuf_off), n);
+		} else if (!(pos % FILE_DIRECT_ALIGN)
+			   && !((uintptr_t)(buf + done) % FILE_DIRECT_ALIGN)
+			   && len - done >= FILE_DIRECT_ALIGN) {
+			n = len - done - (len - done) % FILE_DIRECT_ALIGN;
+			n = file_pread_direct(filedata, buf + done, n, pos);
+			if (n < 0)
+				return n;
+			if (n == 0)
+				break;
+		} else {
+			filedata->dbuf_off = pos - pos % FILE_DIRECT_ALIGN;
+			n = file_pread_direct(filedata, filedata->dbuf,
+					      FILE_DIRECT_BUF_SIZE,
+					      filedata->dbuf_off);
+			filedata->dbuf_len = n < 0 ? 0 : n;
+			dbuf_end = filedata->dbuf_off + filedata->dbuf_len;
+			if (n < 0)
+				return n;
+			if (pos >= dbuf_end)
+				break;
+			continue;
+		}
+
+		done += n;
+		pos += n;
+		filedata->offset = pos;
+	}
+
+	return done;
+}
+
+/* Slot is queued for the part of file following the other slots */
+static int file_uring_next(struct file_data_src *filedata, int i)
+{
+	struct file_uring_slot *slot = &filedata->slots[i];
+	off_t left = filedata->file_size - filedata->next_off;
+
+	/* Tail is read as a whole block, which O_DIRECT needs */
+	left += (FILE_DIRECT_ALIGN - left % FILE_DIRECT_ALIGN)
+		% FILE_DIRECT_ALIGN;
+
+	slot->off = filedata->next_off;
+	slot->want = left < FILE_URING_SLOT_SIZE ? left : FILE_URING_SLOT_SIZE;
+	if (slot->want < 0)
+		slot->want = 0;
+	slot->len = 0;
+	slot->err = 0;
+	filedata->next_off += slot->want;
+
+	return slot->want ? file_uring_queue(filedata, i) : 0;
+}
+
+/* Reads queued before are thrown away, new ones start at off */
+static int file_uring_start(struct file_data_src *filedata, off_t off)
+{
+	int ret;
+	int i;
+
+	ret = file_uring_drain(filedata);
+	if (ret)
+		return ret;
+
+	filedata->head = 0;
+	filedata->next_off = off - off % FILE_DIRECT_ALIGN;
+	for (i = 0; i < FILE_URING_SLOTS; ++i) {
+		ret = file_uring_next(filedata, i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Slot which has been read through is queued again after the others */
+static off_t file_uring_read(struct file_data_src *filedata,
+			     void *data, off_t len)
+{
+	unsigned char *buf = data;
+	struct file_uring_slot *slot;
+	off_t done = 0;
+	off_t pos;
+	off_t n;
+	int ret;
+
+	while (done < len) {
+		pos = filedata->offset;
+		slot = &filedata->slots[filedata->head];
+		if (pos >= filedata->file_size)
+			break;
+
+		if (pos < slot->off || pos > slot->off + slot->want) {
+			ret = file_uring_start(filedata, pos);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		while (slot->busy) {
+			ret = file_uring_complete(filedata);
+			if (ret)
+				return ret;
+		}
+		if (slot->err)
+			return done ? done : slot->err;
+
+		if (pos >= slot->off + slot->len) {
+			/* File is shorter than it was */
+			if (slot->len < slot->want)
+				break;
+			ret = file_uring_next(filedata, filedata->head);
+			if (ret)
+				return ret;
+			filedata->head = (filedata->head + 1) % FILE_URING_SLOTS;
+			continue;
+		}
+
+		n = slot->off + slot->len - pos;
+		if (n > len - done)
+			n = len - done;
+		memcpy(buf + done, slot->data + (pos - slot->off), n);
+		done += n;
+		filedata->offset += n;
+	}
+
+	return done;
+}
+
+static off_t file_read(struct file_data_src *filedata, void *data, off_t len)
+{
+	off_t off = filedata->offset;
+	off_t ret;
+
+	if (filedata->direct) {
+		if (filedata->ring)
+			ret = file_uring_read(filedata, data, len);
+		else
+			ret = file_read_direct(filedata, data, len);
+		if (ret != -EINVAL || filedata->offset != off)
+			return ret;
+		file_direct_off(filedata);
+		if (filedata->ring) {
+			ret = file_uring_start(filedata, off);
+			if (ret)
+				return ret;
+		}
+	}
+
+	t_cache_read(&filedata->cache, off, len);
+
+	if (filedata->map) {
+		if (len > filedata->map_size - off)
+			len = filedata->map_size - off;
+		memcpy(data, filedata->map + off, len);
+		ret = len;
+	} else if (filedata->ring) {
+		/* Moves offset on by itself */
+		ret = file_uring_read(filedata, data, len);
+		if (ret < 0)
+			return ret;
+	} else {
+		ret = read(filedata->fd, data, len);
+		if (ret < 0)
+			return -errno;
+	}
+
+	filedata->offset = off + ret;
+	t_cache_done(&filedata->cache, off, ret);
+	return ret;
+}
+
+static off_t file_sparse_read(void *arg, void *data, off_t len)
+{
+	return file_read(arg, data, len);
+}
+
 static off_t file_get_data_block(struct thor_data_src *src,
 				  void *data, off_t len)
 {
-	off_t ret;
 	struct file_data_src *filedata =
 		container_of(src, struct file_data_src, src);
 
-	ret = read(filedata->fd, data, len);
-	if (ret < 0) {
-		ret = -errno;
+	if (filedata->sparse)
+		return t_sparse_read(filedata->sparse, data, len);
+
+	return file_read(filedata, data, len);
+}
+
+static off_t file_borrow_data_block(struct thor_data_src *src,
+				     void **data, off_t len)
+{
+	struct file_data_src *filedata =
+		container_of(src, struct file_data_src, src);
+
+	if (len > filedata->map_size - filedata->offset)
+		return 0;
+
+	t_cache_read(&filedata->cache, filedata->offset, len);
+	*data = filedata->map + filedata->offset;
+	filedata->offset += len;
+
+	return len;
+}
+
+static void file_release_data_block(struct thor_data_src *src,
+				    void *data, off_t len)
+{
+	struct file_data_src *filedata =
+		container_of(src, struct file_data_src, src);
+
+	t_cache_done(&filedata->cache,
+		     (unsigned char *)data - filedata->map, len);
+}
+
+/* Map the whole image so blocks may be sent straight from page cache */
+static void file_map(struct file_data_src *filedata)
+{
+	void *map;
+
+	if (filedata->entry.size <= 0)
+		return;
+
+	map = mmap(NULL, filedata->entry.size, PROT_READ, MAP_SHARED,
+		   filedata->fd, 0);
+	if (map == MAP_FAILED)
+		return;
+
+	filedata->map = map;
+	filedata->map_size = filedata->entry.size;
+	filedata->offset = 0;
+	filedata->src.borrow_block = file_borrow_data_block;
+	filedata->src.release_block = file_release_data_block;
+}
+
+/* Filesystems which don't support O_DIRECT refuse to set it */
+static void file_direct_on(struct file_data_src *filedata)
+{
+	int flags = fcntl(filedata->fd, F_GETFL);
+
+	if (posix_memalign((void **)&filedata->dbuf, FILE_DIRECT_ALIGN,
+			   FILE_DIRECT_BUF_SIZE))
+		return;
+
+	if (flags < 0 || fcntl(filedata->fd, F_SETFL, flags | O_DIRECT)) {
+		free(filedata->dbuf);
+		filedata->dbuf = NULL;
+		return;
 	}
-	return ret;
+
+	filedata->direct = 1;
+}
+
+static void file_uring_free(struct file_data_src *filedata)
+{
+	int i;
+
+	if (!filedata->ring)
+		return;
+
+	file_uring_drain(filedata);
+	t_uring_free(filedata->ring);
+	filedata->ring = NULL;
+	for (i = 0; i < FILE_URING_SLOTS; ++i)
+		free(filedata->slots[i].data);
+}
+
+/* Plain system calls are used if kernel can't do it */
+static void file_uring_init(struct file_data_src *filedata,
+			    struct thor_data_src_opts *opts)
+{
+	int i;
+
+	if (opts && opts->no_io_uring)
+		return;
+
+	if (t_uring_new(FILE_URING_SLOTS, &filedata->ring)) {
+		filedata->ring = NULL;
+		return;
+	}
+
+	for (i = 0; i < FILE_URING_SLOTS; ++i) {
+		/* Nothing is queued until the first read */
+		filedata->slots[i].off = -1;
+		if (posix_memalign((void **)&filedata->slots[i].data,
+				   FILE_DIRECT_ALIGN, FILE_URING_SLOT_SIZE)) {
+			file_uring_free(filedata);
+			return;
+		}
+	}
+}
+
+/* Sparse image is expanded on the fly, instead of being sent as it is */
+static int file_check_sparse(struct file_data_src *filedata)
+{
+	unsigned char hdr[T_SPARSE_HEADER_LEN];
+	off_t size = 0;
+	int ret;
+
+	if (filedata->entry.size < sizeof(hdr))
+		return 0;
+
+	if (file_read(filedata, hdr, sizeof(hdr)) == sizeof(hdr))
+		size = t_sparse_probe(hdr, sizeof(hdr));
+
+	if (size) {
+		ret = t_sparse_new(hdr, file_sparse_read, filedata,
+				   &filedata->sparse);
+		if (ret)
+			return ret;
+
+		filedata->entry.size = size;
+		filedata->src.borrow_block = NULL;
+		filedata->src.release_block = NULL;
+		return 0;
+	}
+
+	lseek(filedata->fd, 0, SEEK_SET);
+	filedata->offset = 0;
+	return 0;
 }
 
 static const char *file_get_file_name(struct thor_data_src *src)
@@ -106,6 +621,17 @@ static void file_release(struct thor_data_src *src)
 	struct file_data_src *filedata =
 		container_of(src, struct file_data_src, src);
 
+	if (filedata->sparse)
+		t_sparse_free(filedata->sparse);
+	file_uring_free(filedata);
+	if (filedata->compress)
+		t_compress_free(filedata->compress);
+	if (filedata->writer)
+		t_writer_free(filedata->writer);
+	free(filedata->dbuf);
+	t_cache_flush(&filedata->cache);
+	if (filedata->map)
+		munmap(filedata->map, filedata->map_size);
 	close(filedata->fd);
 	free((void *)filedata->filename);
 	free(filedata);
@@ -127,7 +653,8 @@ static struct thor_data_src_entry **file_get_entries(struct thor_data_src *src)
 	return filedata->ent;
 }
 
-int t_file_get_data_src(const char *path, struct thor_data_src **data)
+int t_file_get_data_src(const char *path, struct thor_data_src_opts *opts,
+			struct thor_data_src **data)
 {
 	int ret;
 	char *basefile;
@@ -160,8 +687,8 @@ int t_file_get_data_src(const char *path, struct thor_data_src **data)
 	fdata->entry.size = lseek(fdata->fd, 0, SEEK_END);
 	fdata->ent[0] = &fdata->entry;
 	fdata->ent[1] = NULL;
-	fdata->src.get_file_length = file_get_file_length;
-	fdata->src.get_size = file_get_file_length;
+	fdata->src.get_file_length = file_get_src_length;
+	fdata->src.get_size = file_get_src_length;
 	fdata->src.get_block = file_get_data_block;
 	fdata->src.get_name = file_get_file_name;
 	fdata->src.release = file_release;
@@ -170,6 +697,26 @@ int t_file_get_data_src(const char *path, struct thor_data_src **data)
 	fdata->pos = 0;
 	lseek(fdata->fd, 0, SEEK_SET);
 
+	if (opts && opts->direct_io)
+		file_direct_on(fdata);
+
+	/* Hints would only bring direct reads back to page cache */
+	if (!fdata->direct) {
+		file_map(fdata);
+		t_cache_init(&fdata->cache, fdata->fd, fdata->map,
+			     fdata->entry.size, opts);
+	}
+
+	fdata->file_size = fdata->entry.size;
+	if (!fdata->map)
+		file_uring_init(fdata, opts);
+
+	ret = file_check_sparse(fdata);
+	if (ret) {
+		file_release(&fdata->src);
+		return ret;
+	}
+
 	*data = &fdata->src;
 	return 0;
 
@@ -180,7 +727,8 @@ err_free:
 	return -EINVAL;
 }
 
-int t_file_get_data_dest(const char *path, struct thor_data_src **data)
+int t_file_get_data_dest(const char *path, struct thor_data_src_opts *opts,
+			 struct thor_data_src **data)
 {
 	int ret;
 	char *basefile;
@@ -230,10 +778,29 @@ int t_file_get_data_dest(const char *path, struct thor_data_src **data)
 	fdata->src.get_entries = file_get_entries;
 	fdata->pos = 0;
 	lseek(fdata->fd, 0, SEEK_SET);
+	fdata->writer = t_writer_new(fdata->fd, 0,
+				     !(opts && opts->no_io_uring));
+
+	if (opts && opts->compress != THOR_COMPRESS_NONE) {
+		if (!fdata->writer) {
+			ret = -ENOMEM;
+			goto release;
+		}
+		ret = t_compress_new(fdata->writer, opts->compress,
+				     opts->compress_level, &fdata->compress);
+		if (ret)
+			goto release;
+		fdata->src.get_file_length = file_get_dump_length;
+		fdata->src.get_size = file_get_dump_length;
+	}
 
 	*data = &fdata->src;
 	return 0;
 
+release:
+	file_release(&fdata->src);
+	unlink(path);
+	return ret;
 close_file:
 	close(fdata->fd);
 err_free:
@@ -0,0 +1,375 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Input which can't be mapped (pipes, stdin, files on filesystems without
+ * mmap) is read by a thread of its own into a ring of big aligned buffers,
+ * so the next one is usually ready when it's asked for. Regular files are
+ * also given readahead hints for a window ahead of the reading thread.
+ *
+ * Files sent as they are get the same hints from the data source, which
+ * may also drop pages from page cache once they have been sent.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "thor_internal.h"
+
+#define T_READER_BUFS		4
+#define T_READER_BUF_SIZE	(1024*1024)
+#define T_READER_ALIGN		4096
+
+/* Sent pages are dropped in batches of this size */
+#define T_CACHE_DROP_BATCH	(4*1024*1024)
+
+struct t_reader_buf {
+	unsigned char *data;
+	size_t len;
+	off_t off;
+};
+
+struct t_reader {
+	int fd;
+	int own_fd;
+	int seekable;
+	off_t advised;
+
+	pthread_t thread;
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+
+	struct t_reader_buf bufs[T_READER_BUFS];
+	/* Next buffer to hand out and next one to fill */
+	int head;
+	int tail;
+	int nfull;
+	/* Buffer handed out last time, -1 if none */
+	int cur;
+	/* Offset of next byte to be handed out */
+	off_t pos;
+	/* Where the thread reads next */
+	off_t read_off;
+	/* Bumped on skip, reads started before are thrown away */
+	unsigned int gen;
+	int eof;
+	int err;
+};
+
+/* Ask for a window ahead of pos, once pos gets halfway through the last */
+static void t_readahead(int fd, const void *addr, off_t size, off_t pos,
+			off_t window, off_t *advised)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start, end;
+
+	if (pos + window / 2 < *advised || *advised >= size)
+		return;
+
+	start = pos > *advised ? pos : *advised;
+	start -= start % page;
+	end = pos + window;
+	if (end > size)
+		end = size;
+
+	if (addr)
+		madvise((char *)addr + start, end - start, MADV_WILLNEED);
+	else
+		posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+	*advised = end;
+}
+
+void t_readahead_map(const void *addr, size_t size, size_t pos,
+		     size_t *advised)
+{
+	off_t adv = *advised;
+
+	t_readahead(-1, addr, size, pos, T_READAHEAD_WINDOW, &adv);
+	*advised = adv;
+}
+
+void t_readahead_fd(int fd, off_t pos, off_t *advised)
+{
+	/* Size of pipes and growing files is not known */
+	t_readahead(fd, NULL, INT64_MAX, pos, T_READAHEAD_WINDOW, advised);
+}
+
+void t_cache_init(struct t_cache *cache, int fd, void *map, off_t size,
+		  const struct thor_data_src_opts *opts)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->fd = fd;
+	cache->map = map;
+	cache->size = size;
+	cache->window = T_READAHEAD_WINDOW;
+	if (opts && opts->readahead)
+		cache->window = opts->readahead > 0 ? opts->readahead : 0;
+	cache->drop = opts && opts->drop_cache;
+
+	if (map)
+		madvise(map, size, MADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+void t_cache_read(struct t_cache *cache, off_t off, off_t len)
+{
+	if (cache->window)
+		t_readahead(cache->fd, cache->map, cache->size, off + len,
+			    cache->window, &cache->advised);
+}
+
+static void t_cache_drop(struct t_cache *cache, off_t end)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start = cache->drop_start;
+
+	start += (page - start % page) % page;
+	if (end < cache->size)
+		end -= end % page;
+	if (end <= start)
+		return;
+
+	/* Our own mapping keeps pages in page cache */
+	if (cache->map)
+		madvise((char *)cache->map + start, end - start,
+			MADV_DONTNEED);
+	posix_fadvise(cache->fd, start, end - start, POSIX_FADV_DONTNEED);
+	cache->drop_start = end;
+}
+
+/* Sent data is dropped, pages partly sent are left until the rest is */
+void t_cache_done(struct t_cache *cache, off_t off, off_t len)
+{
+	if (!cache->drop)
+		return;
+
+	if (off != cache->done_end) {
+		t_cache_drop(cache, cache->done_end);
+		cache->drop_start = off;
+	}
+	cache->done_end = off + len;
+
+	if (cache->done_end - cache->drop_start >= T_CACHE_DROP_BATCH
+	    || cache->done_end >= cache->size)
+		t_cache_drop(cache, cache->done_end);
+}
+
+/* Blocks given back out of order may leave the last batch behind */
+void t_cache_flush(struct t_cache *cache)
+{
+	if (cache->drop)
+		t_cache_drop(cache, cache->done_end);
+}
+
+static ssize_t t_reader_fill(struct t_reader *rd, unsigned char *buf,
+			     off_t off)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	if (rd->seekable)
+		t_readahead_fd(rd->fd, off, &rd->advised);
+
+	while (done < T_READER_BUF_SIZE) {
+		if (rd->seekable)
+			n = pread(rd->fd, buf + done, T_READER_BUF_SIZE - done,
+				  off + done);
+		else
+			n = read(rd->fd, buf + done, T_READER_BUF_SIZE - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			break;
+		done += n;
+	}
+
+	return done;
+}
+
+static void *t_reader_thread(void *arg)
+{
+	struct t_reader *rd = arg;
+	struct t_reader_buf *buf;
+	unsigned int gen;
+	ssize_t ret;
+	off_t off;
+
+	pthread_mutex_lock(&rd->lock);
+	while (!rd->stop) {
+		if (rd->eof || rd->err
+		    || rd->nfull + (rd->cur >= 0) == T_READER_BUFS) {
+			pthread_cond_wait(&rd->cond, &rd->lock);
+			continue;
+		}
+
+		buf = &rd->bufs[rd->tail];
+		off = rd->read_off;
+		gen = rd->gen;
+		pthread_mutex_unlock(&rd->lock);
+
+		ret = t_reader_fill(rd, buf->data, off);
+
+		pthread_mutex_lock(&rd->lock);
+		if (gen != rd->gen)
+			continue;
+
+		if (ret < 0) {
+			rd->err = ret;
+		} else {
+			buf->len = ret;
+			buf->off = off;
+			rd->read_off += ret;
+			if (ret < T_READER_BUF_SIZE)
+				rd->eof = 1;
+			if (ret) {
+				rd->tail = (rd->tail + 1) % T_READER_BUFS;
+				++rd->nfull;
+			}
+		}
+		pthread_cond_broadcast(&rd->cond);
+	}
+	pthread_mutex_unlock(&rd->lock);
+
+	return NULL;
+}
+
+ssize_t t_reader_read(struct t_reader *rd, const void **buf)
+{
+	struct t_reader_buf *b;
+	ssize_t ret;
+
+	pthread_mutex_lock(&rd->lock);
+	if (!rd->started) {
+		if (pthread_create(&rd->thread, NULL, t_reader_thread, rd)) {
+			pthread_mutex_unlock(&rd->lock);
+			return -EAGAIN;
+		}
+		rd->started = 1;
+	}
+
+	rd->cur = -1;
+	pthread_cond_broadcast(&rd->cond);
+
+	while (!rd->nfull && !rd->eof && !rd->err)
+		pthread_cond_wait(&rd->cond, &rd->lock);
+
+	if (rd->nfull) {
+		b = &rd->bufs[rd->head];
+		rd->cur = rd->head;
+		rd->head = (rd->head + 1) % T_READER_BUFS;
+		--rd->nfull;
+		rd->pos = b->off + b->len;
+		*buf = b->data;
+		ret = b->len;
+	} else {
+		ret = rd->err;
+	}
+	pthread_mutex_unlock(&rd->lock);
+
+	return ret;
+}
+
+/* Skip forward without reading, buffered data is thrown away */
+off_t t_reader_skip(struct t_reader *rd, off_t len)
+{
+	pthread_mutex_lock(&rd->lock);
+	rd->cur = -1;
+	rd->nfull = 0;
+	rd->head = rd->tail;
+	rd->pos += len;
+	rd->read_off = rd->pos;
+	rd->eof = 0;
+	++rd->gen;
+	pthread_cond_broadcast(&rd->cond);
+	pthread_mutex_unlock(&rd->lock);
+
+	return len;
+}
+
+int t_reader_seekable(struct t_reader *rd)
+{
+	return rd->seekable;
+}
+
+void t_reader_free(struct t_reader *rd)
+{
+	int i;
+
+	if (rd->started) {
+		pthread_mutex_lock(&rd->lock);
+		rd->stop = 1;
+		pthread_cond_broadcast(&rd->cond);
+		pthread_mutex_unlock(&rd->lock);
+		pthread_join(rd->thread, NULL);
+	}
+
+	for (i = 0; i < T_READER_BUFS; ++i)
+		free(rd->bufs[i].data);
+	if (rd->own_fd)
+		close(rd->fd);
+	pthread_cond_destroy(&rd->cond);
+	pthread_mutex_destroy(&rd->lock);
+	free(rd);
+}
+
+/* Reader takes over fd if own_fd is set */
+struct t_reader *t_reader_new(int fd, int own_fd)
+{
+	struct t_reader *rd;
+	struct stat st;
+	int i;
+
+	rd = calloc(1, sizeof(*rd));
+	if (!rd)
+		return NULL;
+
+	rd->fd = fd;
+	rd->own_fd = own_fd;
+	rd->cur = -1;
+	pthread_mutex_init(&rd->lock, NULL);
+	pthread_cond_init(&rd->cond, NULL);
+
+	for (i = 0; i < T_READER_BUFS; ++i) {
+		if (posix_memalign((void **)&rd->bufs[i].data, T_READER_ALIGN,
+				   T_READER_BUF_SIZE)) {
+			rd->own_fd = 0;
+			t_reader_free(rd);
+			return NULL;
+		}
+	}
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		rd->seekable = 1;
+		rd->read_off = rd->pos = lseek(fd, 0, SEEK_CUR);
+		if (rd->read_off < 0)
+			rd->read_off = rd->pos = 0;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	return rd;
+}
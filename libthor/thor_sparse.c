@@ -0,0 +1,268 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Expansion of Android sparse images while they are sent. Only raw chunks
+ * are read from the image, fill and don't care chunks are generated.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "thor_internal.h"
+
+#define SPARSE_MAGIC		0xed26ff3aU
+#define SPARSE_MAJOR		1
+#define SPARSE_CHUNK_HEADER_LEN	12
+
+#define SPARSE_CHUNK_RAW	0xcac1
+#define SPARSE_CHUNK_FILL	0xcac2
+#define SPARSE_CHUNK_DONT_CARE	0xcac3
+#define SPARSE_CHUNK_CRC32	0xcac4
+
+struct t_sparse {
+	t_sparse_read_fn read;
+	void *arg;
+	uint32_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t chunks_left;
+	off_t size;
+	/* Expanded bytes given so far */
+	off_t pos;
+
+	/* Current chunk */
+	uint16_t type;
+	off_t left;
+	unsigned char fill[4];
+};
+
+static uint16_t sp_le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t sp_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+off_t t_sparse_probe(const void *hdr, size_t len)
+{
+	const unsigned char *p = hdr;
+
+	if (len < T_SPARSE_HEADER_LEN || sp_le32(p) != SPARSE_MAGIC
+	    || sp_le16(p + 4) != SPARSE_MAJOR)
+		return 0;
+
+	return (off_t)sp_le32(p + 16) * sp_le32(p + 12);
+}
+
+static int sp_read_full(struct t_sparse *sp, void *buf, off_t len)
+{
+	off_t done = 0;
+	off_t ret;
+
+	while (done < len) {
+		ret = sp->read(sp->arg, (char *)buf + done, len - done);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return -EIO;
+		done += ret;
+	}
+
+	return 0;
+}
+
+/* Headers may be longer than the part we know */
+static int sp_skip(struct t_sparse *sp, off_t len)
+{
+	unsigned char buf[64];
+	off_t n;
+	int ret;
+
+	while (len) {
+		n = len > sizeof(buf) ? sizeof(buf) : len;
+		ret = sp_read_full(sp, buf, n);
+		if (ret)
+			return ret;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int sp_next_chunk(struct t_sparse *sp)
+{
+	unsigned char hdr[SPARSE_CHUNK_HEADER_LEN];
+	unsigned char crc[4];
+	uint64_t out_sz;
+	uint32_t data_sz;
+	uint32_t total_sz;
+	int ret;
+
+	ret = sp_read_full(sp, hdr, sizeof(hdr));
+	if (!ret)
+		ret = sp_skip(sp, sp->chunk_hdr_sz - sizeof(hdr));
+	if (ret)
+		return ret;
+
+	sp->type = sp_le16(hdr);
+	out_sz = (uint64_t)sp_le32(hdr + 4) * sp->blk_sz;
+	total_sz = sp_le32(hdr + 8);
+	if (total_sz < sp->chunk_hdr_sz)
+		return -EINVAL;
+	data_sz = total_sz - sp->chunk_hdr_sz;
+
+	switch (sp->type) {
+	case SPARSE_CHUNK_RAW:
+		if (data_sz != out_sz)
+			return -EINVAL;
+		break;
+	case SPARSE_CHUNK_FILL:
+		if (data_sz != sizeof(sp->fill))
+			return -EINVAL;
+		ret = sp_read_full(sp, sp->fill, sizeof(sp->fill));
+		break;
+	case SPARSE_CHUNK_DONT_CARE:
+		if (data_sz)
+			return -EINVAL;
+		break;
+	case SPARSE_CHUNK_CRC32:
+		/* Checksum of the image so far, not checked */
+		if (data_sz != sizeof(crc))
+			return -EINVAL;
+		ret = sp_read_full(sp, crc, sizeof(crc));
+		out_sz = 0;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (ret)
+		return ret;
+
+	if (out_sz > (uint64_t)(sp->size - sp->pos))
+		return -EINVAL;
+
+	--sp->chunks_left;
+	sp->left = out_sz;
+	return 0;
+}
+
+/* Chunks start at block boundary, so the pattern starts at pos % 4 */
+static void sp_fill(struct t_sparse *sp, unsigned char *buf, off_t len)
+{
+	off_t done;
+	int i;
+
+	if (!memcmp(sp->fill, sp->fill + 1, sizeof(sp->fill) - 1)) {
+		memset(buf, sp->fill[0], len);
+		return;
+	}
+
+	for (i = 0; i < sizeof(sp->fill) && i < len; ++i)
+		buf[i] = sp->fill[(sp->pos + i) % sizeof(sp->fill)];
+
+	/* Pattern repeats every 4 bytes, so copy what is already there */
+	for (done = i; done < len; done *= 2)
+		memcpy(buf + done, buf, done < len - done ? done : len - done);
+}
+
+off_t t_sparse_read(struct t_sparse *sp, void *data, off_t len)
+{
+	unsigned char *buf = data;
+	off_t done = 0;
+	off_t n;
+	int ret;
+
+	while (done < len && sp->pos < sp->size) {
+		if (!sp->left) {
+			if (!sp->chunks_left)
+				return -EIO;
+			ret = sp_next_chunk(sp);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		n = len - done < sp->left ? len - done : sp->left;
+		switch (sp->type) {
+		case SPARSE_CHUNK_RAW:
+			ret = sp_read_full(sp, buf + done, n);
+			if (ret)
+				return ret;
+			break;
+		case SPARSE_CHUNK_FILL:
+			sp_fill(sp, buf + done, n);
+			break;
+		default:
+			memset(buf + done, 0, n);
+			break;
+		}
+
+		done += n;
+		sp->left -= n;
+		sp->pos += n;
+	}
+
+	return done;
+}
+
+void t_sparse_free(struct t_sparse *sp)
+{
+	free(sp);
+}
+
+/* Header has been read already, the rest of the image is read with read */
+int t_sparse_new(const void *hdr, t_sparse_read_fn read, void *arg,
+		 struct t_sparse **sparse)
+{
+	const unsigned char *p = hdr;
+	struct t_sparse *sp;
+	uint32_t file_hdr_sz = sp_le16(p + 8);
+	int ret;
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp)
+		return -ENOMEM;
+
+	sp->read = read;
+	sp->arg = arg;
+	sp->chunk_hdr_sz = sp_le16(p + 10);
+	sp->blk_sz = sp_le32(p + 12);
+	sp->size = t_sparse_probe(hdr, T_SPARSE_HEADER_LEN);
+	sp->chunks_left = sp_le32(p + 20);
+
+	if (file_hdr_sz < T_SPARSE_HEADER_LEN
+	    || sp->chunk_hdr_sz < SPARSE_CHUNK_HEADER_LEN
+	    || !sp->blk_sz || sp->blk_sz % 4) {
+		ret = -EINVAL;
+		goto free_sp;
+	}
+
+	ret = sp_skip(sp, file_hdr_sz - T_SPARSE_HEADER_LEN);
+	if (ret)
+		goto free_sp;
+
+	*sparse = sp;
+	return 0;
+free_sp:
+	free(sp);
+	return ret;
+}
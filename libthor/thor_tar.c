@@ -14,12 +14,18 @@
  * limitations under the License.
  */
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/queue.h>
 
 #include "thor.h"
@@ -30,6 +36,38 @@ struct entry_container {
 	STAILQ_ENTRY(entry_container) node;
 };
 
+#define TAR_INDEX_SUFFIX	".thor-idx"
+#define TAR_GZIP_INDEX_SUFFIX	".thor-gzi"
+#define TAR_INDEX_MAGIC		"thor-idx 4"
+/* Bytes hashed at each end of archive to tell it apart from its copies */
+#define TAR_FINGERPRINT_LEN	(64*1024)
+
+/* What an index file is valid for */
+struct tar_index_key {
+	off_t size;
+	time_t mtime_sec;
+	long mtime_nsec;
+	uint64_t fingerprint;
+};
+
+/* Parallel decompression of mapped compressed archives */
+struct tar_decomp_opts {
+	int threads;
+	/* Archive to keep gzip access points for, NULL if they are not kept */
+	const struct tar_index_key *key;
+	/* Set if archive is decompressed by us, not by libarchive */
+	struct t_decomp *dc;
+};
+
+/* Whole archive mapped and passed to libarchive as a single block */
+struct tar_map {
+	void *addr;
+	size_t size;
+	size_t pos;
+	/* Kept open for page cache hints */
+	int fd;
+};
+
 struct tar_data_src {
 	struct thor_data_src src;
 	struct archive *ar;
@@ -37,6 +75,46 @@ struct tar_data_src {
 	off_t total_size;
 	struct thor_data_src_entry **entries;
 	STAILQ_HEAD(ent, entry_container) ent;
+	off_t nent;
+	/*
+	 * Index is built from headers seen while streaming or, if asked for
+	 * earlier, by a separate walk through the archive
+	 */
+	int indexed;
+	char *path;
+	/* Index is kept in a file next to the archive */
+	int index_cache;
+	int index_loaded;
+	struct tar_index_key key;
+	struct tar_map map;
+	/* Uncompressed archive which couldn't be mapped, -1 otherwise */
+	int fd;
+	off_t arch_size;
+	/* Readahead and page cache use of data read directly */
+	struct t_cache cache;
+	int decomp_threads;
+	/* Parallel decompression, owned by libarchive reader */
+	struct t_decomp *dc;
+	/*
+	 * Data of current entry is taken straight from the archive file at
+	 * data_off, libarchive only parses headers and skips over data
+	 */
+	int direct;
+	off_t data_off;
+	/* Current data block of current entry, as given by libarchive */
+	const char *blk;
+	size_t blk_len;
+	off_t blk_off;
+	int blk_eof;
+	/* Position in current entry */
+	off_t pos;
+	/* Current entry is an Android sparse image, expanded while read */
+	struct t_sparse *sparse;
+	off_t sparse_size;
+	/* Start of entry read to probe it, given back if it's not sparse */
+	unsigned char peek[T_SPARSE_HEADER_LEN];
+	int peek_len;
+	int peek_pos;
 };
 
 static off_t tar_get_file_length(struct thor_data_src *src)
@@ -44,15 +122,411 @@ static off_t tar_get_file_length(struct thor_data_src *src)
 	struct tar_data_src *tardata =
 		container_of(src, struct tar_data_src, src);
 
+	if (tardata->sparse)
+		return tardata->sparse_size;
+
 	return archive_entry_size(tardata->ae);
 }
 
-static off_t tar_get_size(struct thor_data_src *src)
+static void tar_index_clear(struct tar_data_src *tardata)
 {
-	struct tar_data_src *tardata =
-		container_of(src, struct tar_data_src, src);
+	struct entry_container *container;
 
-	return tardata->total_size;
+	while (!STAILQ_EMPTY(&tardata->ent)) {
+		container = STAILQ_FIRST(&tardata->ent);
+		STAILQ_REMOVE_HEAD(&tardata->ent, node);
+		free(container->entry.name);
+		free(container);
+	}
+	tardata->nent = 0;
+	tardata->total_size = 0;
+}
+
+/* Called right after the header has been read, before any of the data */
+static struct entry_container *tar_index_add(struct tar_data_src *tardata,
+					     struct archive_entry *ae)
+{
+	struct entry_container *container;
+
+	container = calloc(1, sizeof(*container));
+	if (!container)
+		return NULL;
+
+	container->entry.name = strdup(archive_entry_pathname(ae));
+	if (!container->entry.name) {
+		free(container);
+		return NULL;
+	}
+
+	container->entry.size = archive_entry_size(ae);
+	tardata->total_size += container->entry.size;
+	++tardata->nent;
+	STAILQ_INSERT_TAIL(&tardata->ent, container, node);
+
+	return container;
+}
+
+/* Entry turned out to be a sparse image, it is counted as expanded */
+static void tar_index_set_size(struct tar_data_src *tardata,
+			       struct entry_container *container, off_t size)
+{
+	tardata->total_size += size - container->entry.size;
+	container->entry.size = size;
+}
+
+static uint64_t tar_fnv1a(uint64_t hash, const unsigned char *buf, size_t len)
+{
+	while (len--) {
+		hash ^= *buf++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Identify archive by its size, mtime and data at both ends */
+static int tar_index_get_key(const char *path, struct tar_index_key *key)
+{
+	unsigned char *buf;
+	struct stat st;
+	ssize_t len;
+	off_t off;
+	int fd;
+	int i;
+	int ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		ret = -EINVAL;
+		goto close_fd;
+	}
+
+	buf = malloc(TAR_FINGERPRINT_LEN);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto close_fd;
+	}
+
+	key->size = st.st_size;
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->fingerprint = 0xcbf29ce484222325ULL;
+
+	/* Head and tail of the archive, they overlap for small ones */
+	for (i = 0; i < 2; ++i) {
+		off = i ? st.st_size - TAR_FINGERPRINT_LEN : 0;
+		if (off < 0)
+			off = 0;
+
+		len = pread(fd, buf, TAR_FINGERPRINT_LEN, off);
+		if (len < 0) {
+			ret = -errno;
+			break;
+		}
+		key->fingerprint = tar_fnv1a(key->fingerprint, buf, len);
+	}
+
+	free(buf);
+close_fd:
+	close(fd);
+	return ret;
+}
+
+static char *tar_index_path(const char *path)
+{
+	char *ipath;
+
+	ipath = malloc(strlen(path) + sizeof(TAR_INDEX_SUFFIX));
+	if (ipath)
+		sprintf(ipath, "%s" TAR_INDEX_SUFFIX, path);
+
+	return ipath;
+}
+
+static int tar_index_load(struct tar_data_src *tardata)
+{
+	struct tar_index_key key;
+	struct entry_container *container;
+	long long size, total, nent;
+	unsigned long long fingerprint;
+	long long mtime_sec;
+	long mtime_nsec;
+	size_t name_len;
+	char magic[sizeof(TAR_INDEX_MAGIC)];
+	char *ipath;
+	FILE *f;
+	int ret = -EINVAL;
+
+	ipath = tar_index_path(tardata->path);
+	if (!ipath)
+		return -ENOMEM;
+
+	f = fopen(ipath, "r");
+	free(ipath);
+	if (!f)
+		return -errno;
+
+	key = tardata->key;
+	if (!fgets(magic, sizeof(magic), f)
+	    || strcmp(magic, TAR_INDEX_MAGIC)
+	    || fscanf(f, "\n%lld %lld %ld %llx %lld %lld\n", &size,
+		      &mtime_sec, &mtime_nsec, &fingerprint, &nent,
+		      &total) != 6
+	    || size != key.size || mtime_sec != key.mtime_sec
+	    || mtime_nsec != key.mtime_nsec || fingerprint != key.fingerprint)
+		goto close_f;
+
+	while (tardata->nent < nent) {
+		if (fscanf(f, "%lld %zu", &size, &name_len) != 2
+		    || name_len > PATH_MAX || fgetc(f) != ' ')
+			goto clear;
+
+		container = calloc(1, sizeof(*container));
+		if (!container) {
+			ret = -ENOMEM;
+			goto clear;
+		}
+		STAILQ_INSERT_TAIL(&tardata->ent, container, node);
+		++tardata->nent;
+
+		container->entry.name = calloc(1, name_len + 1);
+		if (!container->entry.name) {
+			ret = -ENOMEM;
+			goto clear;
+		}
+
+		if (fread(container->entry.name, 1, name_len, f) != name_len
+		    || fgetc(f) != '\n')
+			goto clear;
+
+		container->entry.size = size;
+		tardata->total_size += size;
+	}
+
+	if (tardata->total_size != total)
+		goto clear;
+
+	tardata->index_loaded = 1;
+	fclose(f);
+	return 0;
+clear:
+	tar_index_clear(tardata);
+close_f:
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Index is written to a temporary file which is renamed over the old one,
+ * so concurrent runs never see it half written. Failures are not fatal,
+ * the archive may be on a read-only medium.
+ */
+static int tar_index_save(struct tar_data_src *tardata)
+{
+	struct tar_index_key *key = &tardata->key;
+	struct entry_container *container;
+	char *ipath;
+	char *tmp;
+	FILE *f;
+	mode_t mask;
+	int fd;
+	int ret = 0;
+
+	ipath = tar_index_path(tardata->path);
+	if (!ipath)
+		return -ENOMEM;
+
+	tmp = malloc(strlen(ipath) + sizeof(".XXXXXX"));
+	if (!tmp) {
+		ret = -ENOMEM;
+		goto free_ipath;
+	}
+	sprintf(tmp, "%s.XXXXXX", ipath);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = -errno;
+		goto free_tmp;
+	}
+
+	/* Other users of the archive should be able to use it too */
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		ret = -errno;
+		close(fd);
+		goto unlink_tmp;
+	}
+
+	fprintf(f, TAR_INDEX_MAGIC "\n%lld %lld %ld %llx %lld %lld\n",
+		(long long)key->size, (long long)key->mtime_sec,
+		key->mtime_nsec, (unsigned long long)key->fingerprint,
+		(long long)tardata->nent, (long long)tardata->total_size);
+
+	STAILQ_FOREACH(container, &tardata->ent, node)
+		fprintf(f, "%lld %zu %s\n",
+			(long long)container->entry.size, strlen(container->entry.name), container->entry.name);
+
+	if (ferror(f) | fclose(f)) {
+		ret = -EIO;
+		goto unlink_tmp;
+	}
+
+	if (!rename(tmp, ipath))
+		goto free_tmp;
+
+	ret = -errno;
+unlink_tmp:
+	unlink(tmp);
+free_tmp:
+	free(tmp);
+free_ipath:
+	free(ipath);
+	return ret;
+}
+
+/* All headers have been seen, make the index available */
+static int tar_index_finish(struct tar_data_src *tardata)
+{
+	struct entry_container *container;
+	int i = 0;
+
+	tardata->entries = calloc(tardata->nent + 1,
+				  sizeof(*(tardata->entries)));
+	if (!tardata->entries)
+		return -ENOMEM;
+
+	STAILQ_FOREACH(container, &tardata->ent, node)
+		tardata->entries[i++] = &container->entry;
+
+	tardata->indexed = 1;
+
+	if (tardata->index_cache && !tardata->index_loaded)
+		tar_index_save(tardata);
+
+	return 0;
+}
+
+/* Get next block from libarchive if there is nothing left in current one */
+static int tar_next_block(struct tar_data_src *tardata)
+{
+	const void *blk;
+	size_t len;
+	int64_t off;
+	int ret;
+
+	if (tardata->blk_eof
+	    || tardata->pos < tardata->blk_off + (off_t)tardata->blk_len)
+		return 0;
+
+	ret = archive_read_data_block(tardata->ar, &blk, &len, &off);
+	if (ret == ARCHIVE_EOF) {
+		tardata->blk_eof = 1;
+		tardata->blk_len = 0;
+		return 0;
+	}
+
+	if (ret != ARCHIVE_OK && ret != ARCHIVE_WARN)
+		return -EIO;
+
+	tardata->blk = blk;
+	tardata->blk_len = len;
+	tardata->blk_off = off;
+
+	return 0;
+}
+
+static off_t tar_get_direct_block(struct tar_data_src *tardata,
+				  char *buf, off_t len)
+{
+	off_t left = archive_entry_size(tardata->ae) - tardata->pos;
+	off_t off = tardata->data_off + tardata->pos;
+	off_t done = 0;
+	ssize_t n;
+
+	if (len > left)
+		len = left;
+
+	t_cache_read(&tardata->cache, off, len);
+
+	if (tardata->map.addr) {
+		memcpy(buf, (char *)tardata->map.addr + off, len);
+		done = len;
+	}
+
+	while (done < len) {
+		n = pread(tardata->fd, buf + done, len - done, off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		done += n;
+	}
+
+	t_cache_done(&tardata->cache, off, done);
+	tardata->pos += done;
+	return done;
+}
+
+/*
+ * Gather data from blocks held by libarchive. Holes in sparse entries
+ * are filled with zeros.
+ */
+static off_t tar_read_entry(struct tar_data_src *tardata,
+			    void *data, off_t len)
+{
+	char *buf = data;
+	off_t done = 0;
+	off_t n;
+	int ret;
+
+	if (tardata->direct)
+		return tar_get_direct_block(tardata, data, len);
+
+	while (done < len) {
+		ret = tar_next_block(tardata);
+		if (ret)
+			return ret;
+
+		if (tardata->blk_eof) {
+			n = archive_entry_size(tardata->ae) - tardata->pos;
+			if (n <= 0)
+				break;
+			if (n > len - done)
+				n = len - done;
+			memset(buf + done, 0, n);
+		} else if (tardata->pos < tardata->blk_off) {
+			n = tardata->blk_off - tardata->pos;
+			if (n > len - done)
+				n = len - done;
+			memset(buf + done, 0, n);
+		} else {
+			n = tardata->blk_off + tardata->blk_len - tardata->pos;
+			if (n > len - done)
+				n = len - done;
+			memcpy(buf + done,
+			       tardata->blk + (tardata->pos - tardata->blk_off),
+			       n);
+		}
+
+		done += n;
+		tardata->pos += n;
+	}
+
+	return done;
+}
+
+static off_t tar_sparse_read(void *arg, void *data, off_t len)
+{
+	return tar_read_entry(arg, data, len);
 }
 
 static off_t tar_get_data_block(struct thor_data_src *src,
@@ -60,8 +534,79 @@ static off_t tar_get_data_block(struct thor_data_src *src,
 {
 	struct tar_data_src *tardata =
 		container_of(src, struct tar_data_src, src);
+	off_t n = 0;
+	off_t ret;
+
+	if (tardata->sparse)
+		return t_sparse_read(tardata->sparse, data, len);
+
+	if (tardata->peek_pos < tardata->peek_len) {
+		n = tardata->peek_len - tardata->peek_pos;
+		if (n > len)
+			n = len;
+		memcpy(data, tardata->peek + tardata->peek_pos, n);
+		tardata->peek_pos += n;
+		if (n == len)
+			return n;
+	}
 
-	return archive_read_data(tardata->ar, data, len);
+	ret = tar_read_entry(tardata, (char *)data + n, len - n);
+	return ret < 0 ? ret : n + ret;
+}
+
+/*
+ * Blocks stay valid only until next read from libarchive, unless they
+ * point into our mapping of uncompressed archive. Only those are lent.
+ */
+static off_t tar_borrow_data_block(struct thor_data_src *src,
+				   void **data, off_t len)
+{
+	struct tar_data_src *tardata =
+		container_of(src, struct tar_data_src, src);
+	const char *map = tardata->map.addr;
+	const char *p;
+	int ret;
+
+	if (tardata->sparse || tardata->peek_pos < tardata->peek_len)
+		return 0;
+
+	if (tardata->direct) {
+		if (!map || archive_entry_size(tardata->ae) - tardata->pos < len)
+			return 0;
+
+		t_cache_read(&tardata->cache,
+			     tardata->data_off + tardata->pos, len);
+		*data = (void *)(map + tardata->data_off + tardata->pos);
+		tardata->pos += len;
+		return len;
+	}
+
+	ret = tar_next_block(tardata);
+	if (ret)
+		return ret;
+
+	if (tardata->blk_eof || tardata->pos < tardata->blk_off
+	    || tardata->blk_off + (off_t)tardata->blk_len - tardata->pos < len)
+		return 0;
+
+	p = tardata->blk + (tardata->pos - tardata->blk_off);
+	if (p < map || p + len > map + tardata->map.size)
+		return 0;
+
+	*data = (void *)p;
+	tardata->pos += len;
+
+	return len;
+}
+
+static void tar_release_data_block(struct thor_data_src *src,
+				   void *data, off_t len)
+{
+	struct tar_data_src *tardata =
+		container_of(src, struct tar_data_src, src);
+
+	t_cache_done(&tardata->cache, (char *)data - (char *)tardata->map.addr,
+		     len);
 }
 
 static const char *tar_get_file_name(struct thor_data_src *src)
@@ -72,46 +617,334 @@ static const char *tar_get_file_name(struct thor_data_src *src)
 	return archive_entry_pathname(tardata->ae);
 }
 
+/* Archive is read without any decompression filter */
+static int tar_is_plain(struct tar_data_src *tardata)
+{
+	return !tardata->dc
+		&& archive_filter_code(tardata->ar, 0) == ARCHIVE_FILTER_NONE;
+}
+
+/*
+ * In uncompressed archive entry data is stored as is right after the
+ * headers libarchive has just consumed. Sparse entries need its help.
+ */
+static void tar_check_direct(struct tar_data_src *tardata)
+{
+	off_t size = archive_entry_size(tardata->ae);
+	off_t arch_size;
+
+	if (tardata->map.addr)
+		arch_size = tardata->map.size;
+	else if (tardata->fd >= 0)
+		arch_size = tardata->arch_size;
+	else
+		return;
+
+	if (!tar_is_plain(tardata) || archive_entry_sparse_count(tardata->ae))
+		return;
+
+	tardata->data_off = archive_filter_bytes(tardata->ar, 0);
+	tardata->direct = tardata->data_off + size <= arch_size;
+}
+
+/*
+ * Android sparse images are expanded on the fly. Anything else gets its
+ * first bytes back, directly read entries just by rewinding.
+ */
+static int tar_check_sparse(struct tar_data_src *tardata)
+{
+	off_t len;
+
+	if (archive_entry_size(tardata->ae) < T_SPARSE_HEADER_LEN)
+		return 0;
+
+	len = tar_read_entry(tardata, tardata->peek, sizeof(tardata->peek));
+	if (len < 0)
+		return len;
+
+	tardata->sparse_size = t_sparse_probe(tardata->peek, len);
+	if (tardata->sparse_size) {
+		return t_sparse_new(tardata->peek, tar_sparse_read, tardata,
+				    &tardata->sparse);
+	}
+
+	if (tardata->direct)
+		tardata->pos = 0;
+	else
+		tardata->peek_len = len;
+
+	return 0;
+}
+
 static int tar_next_file(struct thor_data_src *src)
 {
 	struct tar_data_src *tardata =
 		container_of(src, struct tar_data_src, src);
+	struct entry_container *container = NULL;
 	int ret;
 
+	tardata->blk = NULL;
+	tardata->blk_len = 0;
+	tardata->blk_off = 0;
+	tardata->blk_eof = 0;
+	tardata->pos = 0;
+	tardata->direct = 0;
+	tardata->peek_len = 0;
+	tardata->peek_pos = 0;
+	if (tardata->sparse) {
+		t_sparse_free(tardata->sparse);
+		tardata->sparse = NULL;
+	}
+
 	ret = archive_read_next_header2(tardata->ar, tardata->ae);
-	if (ret == ARCHIVE_OK)
+	if (ret == ARCHIVE_OK) {
+		tar_check_direct(tardata);
+		if (!tardata->indexed) {
+			container = tar_index_add(tardata, tardata->ae);
+			if (!container)
+				return -ENOMEM;
+		}
+
+		ret = tar_check_sparse(tardata);
+		if (ret)
+			return ret;
+
+		if (container && tardata->sparse)
+			tar_index_set_size(tardata, container,
+					   tardata->sparse_size);
 		return 1;
+	}
 
-	if (ret == ARCHIVE_EOF)
+	if (ret == ARCHIVE_EOF) {
+		if (!tardata->indexed) {
+			ret = tar_index_finish(tardata);
+			if (ret)
+				return ret;
+		}
+		if (tardata->dc)
+			t_decomp_finish(tardata->dc);
 		return 0;
+	}
 
 	return -EINVAL;
 }
 
+static ssize_t tar_map_read(struct archive *ar, void *client_data,
+			    const void **buf)
+{
+	struct tar_map *map = client_data;
+	size_t len = map->size - map->pos;
+
+	*buf = (char *)map->addr + map->pos;
+	map->pos += len;
+
+	return len;
+}
+
+static int tar_map(const char *path, struct tar_map *map)
+{
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0
+	    || (off_t)(size_t)st.st_size != st.st_size) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return -errno;
+	}
+
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+	map->addr = addr;
+	map->size = st.st_size;
+	map->pos = 0;
+	map->fd = fd;
+
+	return 0;
+}
+
+static void tar_unmap(struct tar_map *map)
+{
+	if (map->addr) {
+		munmap(map->addr, map->size);
+		close(map->fd);
+	}
+	map->addr = NULL;
+}
+
 static void tar_release(struct thor_data_src *src)
 {
 	struct tar_data_src *tardata =
 		container_of(src, struct tar_data_src, src);
-	struct entry_container *container;
 
-	while (!STAILQ_EMPTY(&tardata->ent)) {
-		container = STAILQ_FIRST(&tardata->ent);
-		STAILQ_REMOVE_HEAD(&tardata->ent, node);
-		free(container->entry.name);
-		free(container);
-	}
+	tar_index_clear(tardata);
 	free(tardata->entries);
+	free(tardata->path);
+	if (tardata->sparse)
+		t_sparse_free(tardata->sparse);
 	archive_read_close(tardata->ar);
 	archive_read_finish(tardata->ar);
 	archive_entry_free(tardata->ae);
+	t_cache_flush(&tardata->cache);
+	tar_unmap(&tardata->map);
+	if (tardata->fd >= 0)
+		close(tardata->fd);
 	free(tardata);
 }
 
+static ssize_t tar_decomp_read(struct archive *ar, void *client_data,
+			       const void **buf)
+{
+	ssize_t ret;
+
+	ret = t_decomp_read(client_data, buf);
+	if (ret < 0) {
+		archive_set_error(ar, -ret, "Unable to decompress data");
+		return -1;
+	}
+
+	return ret;
+}
+
+static int tar_decomp_close(struct archive *ar, void *client_data)
+{
+	t_decomp_free(client_data);
+	return ARCHIVE_OK;
+}
+
+static const struct tar_decomp_format {
+	int (*probe)(const void *data, size_t size);
+	struct t_decomp *(*new)(const void *data, size_t size, int threads);
+} tar_decomp_formats[] = {
+	{ t_gzip_probe, t_gzip_new },
+	{ t_bzip2_probe, t_bzip2_new },
+	{ t_zstd_probe, t_zstd_new },
+	{ t_xz_probe, t_xz_new },
+	{ t_lz4_probe, t_lz4_new },
+};
+
+static const struct tar_decomp_format *tar_find_decomp(struct tar_map *map)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tar_decomp_formats); ++i)
+		if (tar_decomp_formats[i].probe(map->addr, map->size))
+			return &tar_decomp_formats[i];
+
+	return NULL;
+}
+
+/* Mapped compressed archive is decompressed by several threads if allowed */
+static int tar_open_decomp(struct archive *ar, const char *path,
+			   struct tar_map *map,
+			   const struct tar_decomp_format *fmt,
+			   struct tar_decomp_opts *dco)
+{
+	struct t_decomp *dc;
+	char *ipath;
+	int ret;
+
+	dc = fmt->new(map->addr, map->size, dco->threads);
+	if (!dc)
+		return -ENOMEM;
+
+	if (fmt->probe == t_gzip_probe && dco->key) {
+		ipath = malloc(strlen(path) + sizeof(TAR_GZIP_INDEX_SUFFIX));
+		if (!ipath) {
+			t_decomp_free(dc);
+			return -ENOMEM;
+		}
+		sprintf(ipath, "%s" TAR_GZIP_INDEX_SUFFIX, path);
+
+		ret = t_gzip_use_index(dc, ipath, dco->key, sizeof(*dco->key));
+		free(ipath);
+		if (ret) {
+			t_decomp_free(dc);
+			return ret;
+		}
+	}
+
+	dco->dc = dc;
+
+	/* Closing callback releases dc even if open fails */
+	return archive_read_open(ar, dc, NULL, tar_decomp_read,
+				 tar_decomp_close);
+}
+
+static ssize_t tar_reader_read(struct archive *ar, void *client_data,
+			       const void **buf)
+{
+	ssize_t ret;
+
+	ret = t_reader_read(client_data, buf);
+	if (ret < 0) {
+		archive_set_error(ar, -ret, "Unable to read archive");
+		return -1;
+	}
+
+	return ret;
+}
+
+static la_int64_t tar_reader_skip(struct archive *ar, void *client_data,
+				  la_int64_t request)
+{
+	return t_reader_skip(client_data, request);
+}
+
+static int tar_reader_close(struct archive *ar, void *client_data)
+{
+	t_reader_free(client_data);
+	return ARCHIVE_OK;
+}
+
+/* Archive which can't be mapped is read ahead by a thread of its own */
+static int tar_open_reader(struct archive *ar, const char *path)
+{
+	struct t_reader *rd;
+	int fd;
+
+	if (!strcmp(path, "-")) {
+		rd = t_reader_new(STDIN_FILENO, 0);
+	} else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return -errno;
+		rd = t_reader_new(fd, 1);
+		if (!rd)
+			close(fd);
+	}
+	if (!rd)
+		return -ENOMEM;
+
+	/* Closing callback releases rd even if open fails */
+	return archive_read_open2(ar, rd, NULL, tar_reader_read,
+				  t_reader_seekable(rd) ? tar_reader_skip : NULL,
+				  tar_reader_close);
+}
+
+/*
+ * Regular files are mapped if possible, libarchive then reads uncompressed
+ * archives without copying and gives us blocks pointing to the mapping.
+ * Mapping which is already set up is reused and left to the caller.
+ */
 static int tar_prep_read(const char *path, struct archive **archive,
-			 struct archive_entry **aentry)
+			 struct archive_entry **aentry, struct tar_map *map,
+			 struct tar_decomp_opts *dco)
 {
+	const struct tar_decomp_format *fmt = NULL;
 	struct archive *ar;
 	struct archive_entry *ae;
+	int mapped = 0;
 	int ret;
 
 	ar = archive_read_new();
@@ -125,11 +958,22 @@ static int tar_prep_read(const char *path, struct archive **archive,
 	archive_read_support_format_tar(ar);
 	archive_read_support_compression_gzip(ar);
 	archive_read_support_compression_bzip2(ar);
+	archive_read_support_filter_zstd(ar);
+	archive_read_support_filter_xz(ar);
+	archive_read_support_filter_lz4(ar);
+
+	if (!map->addr && strcmp(path, "-"))
+		mapped = !tar_map(path, map);
+
+	if (map->addr && dco && dco->threads > 1)
+		fmt = tar_find_decomp(map);
 
-	if (!strcmp(path, "-"))
-		ret = archive_read_open_FILE(ar, stdin);
+	if (fmt)
+		ret = tar_open_decomp(ar, path, map, fmt, dco);
+	else if (map->addr)
+		ret = archive_read_open(ar, map, NULL, tar_map_read, NULL);
 	else
-		ret = archive_read_open_filename(ar, path, 512);
+		ret = tar_open_reader(ar, path);
 
 	if (ret)
 		goto cleanup;
@@ -138,130 +982,226 @@ static int tar_prep_read(const char *path, struct archive **archive,
 	*aentry = ae;
 	return 0;
 cleanup:
+	if (mapped)
+		tar_unmap(map);
 	archive_entry_free(ae);
 read_finish:
 	archive_read_finish(ar);
 	return ret;
 }
 
-static int tar_calculate_total(const char *path, struct tar_data_src *tardata)
+/*
+ * Walk through all headers of the archive using separate reader. Data of
+ * mapped uncompressed archive is just skipped, apart from its first bytes
+ * which tell sparse images apart, anything else has to be read through
+ * once more.
+ */
+static int tar_index_walk(struct tar_data_src *tardata)
 {
 	struct archive *ar;
 	struct archive_entry *ae;
-	char *name;
-	off_t size;
 	struct entry_container *container;
-	int i;
+	struct tar_map map = tardata->map;
+	struct tar_decomp_opts dco = {
+		.threads = tardata->decomp_threads,
+	};
+	unsigned char peek[T_SPARSE_HEADER_LEN];
+	ssize_t len;
+	off_t size;
 	int ret;
 
-	STAILQ_INIT(&tardata->ent);
-	tardata->entries = NULL;
+	if (!map.addr && !strcmp(tardata->path, "-"))
+		return -ESPIPE;
 
-	/*
-	 * Yes this is very ugly but libarchive doesn't
-	 * allow to reset position :(
-	 */
-	ret = tar_prep_read(path, &ar, &ae);
-	if (ret)
-		goto out;
+	tar_index_clear(tardata);
 
-	tardata->total_size = 0;
-	for (i = 0; 1; ++i) {
-		ret = archive_read_next_header2(ar, ae);
-		if (ret == ARCHIVE_EOF) {
-			break;
-		} else if (ret != ARCHIVE_OK) {
-			tardata->total_size = -EINVAL;
-			goto cleanup;
-		}
+	map.pos = 0;
+	ret = tar_prep_read(tardata->path, &ar, &ae, &map, &dco);
+	if (ret)
+		return ret;
 
-		name = strdup(archive_entry_pathname(ae));
-		if (!name) {
+	while ((ret = archive_read_next_header2(ar, ae)) == ARCHIVE_OK) {
+		container = tar_index_add(tardata, ae);
+		if (!container) {
 			ret = -ENOMEM;
 			goto cleanup;
 		}
 
-		size = archive_entry_size(ae);
-		tardata->total_size += size;
-
-		container = calloc(1, sizeof(*container));
-		if (!container) {
-			free(name);
-			ret = -ENOMEM;
+		/* Sparse images are counted as expanded */
+		if (archive_entry_size(ae) < sizeof(peek))
+			continue;
+		len = archive_read_data(ar, peek, sizeof(peek));
+		if (len < 0) {
+			ret = -EIO;
 			goto cleanup;
 		}
-
-		container->entry.name = name;
-		container->entry.size = size;
-		STAILQ_INSERT_TAIL(&tardata->ent, container, node);
+		size = t_sparse_probe(peek, len);
+		if (size)
+			tar_index_set_size(tardata, container, size);
 	}
 
-	tardata->entries = calloc(i + 1, sizeof(*(tardata->entries)));
-	if (!tardata->entries) {
-		ret = -ENOMEM;
+	if (ret != ARCHIVE_EOF) {
+		ret = -EINVAL;
 		goto cleanup;
 	}
 
-	i = 0;
-	STAILQ_FOREACH(container, &tardata->ent, node)
-		tardata->entries[i++] = &container->entry;
-
-	ret = 0;
+	ret = tar_index_finish(tardata);
 cleanup:
-	if (ret) {
-		while (!STAILQ_EMPTY(&tardata->ent)) {
-			container = STAILQ_FIRST(&tardata->ent);
-			STAILQ_REMOVE_HEAD(&tardata->ent, node);
-			free(container);
-		}
-	}
+	if (ret)
+		tar_index_clear(tardata);
 	archive_read_close(ar);
 	archive_read_finish(ar);
 	archive_entry_free(ae);
-out:
+	if (map.addr != tardata->map.addr)
+		tar_unmap(&map);
 	return ret;
 }
 
+static off_t tar_get_size(struct thor_data_src *src)
+{
+	struct tar_data_src *tardata =
+		container_of(src, struct tar_data_src, src);
+	int ret;
+
+	if (!tardata->indexed) {
+		ret = tar_index_walk(tardata);
+		if (ret)
+			return ret;
+	}
+
+	return tardata->total_size;
+}
+
+/*
+ * Uncompressed archive which couldn't be mapped, e.g. too big for address
+ * space, is still read directly with pread() if it is seekable
+ */
+static void tar_open_direct(struct tar_data_src *tardata)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(tardata->path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	tardata->fd = fd;
+	tardata->arch_size = st.st_size;
+}
+
 static struct thor_data_src_entry **tar_get_entries(struct thor_data_src *src)
 {
 	struct tar_data_src *tardata =
 		container_of(src, struct tar_data_src, src);
 
+	if (!tardata->indexed && tar_index_walk(tardata))
+		return NULL;
+
 	return tardata->entries;
 }
 
-int t_tar_get_data_src(const char *path, struct thor_data_src **data)
+static int tar_has_index(struct thor_data_src *src)
+{
+	struct tar_data_src *tardata =
+		container_of(src, struct tar_data_src, src);
+
+	return tardata->indexed || ((tardata->map.addr || tardata->fd >= 0)
+				    && tar_is_plain(tardata));
+}
+
+static int tar_get_decompress_stats(struct thor_data_src *src,
+				    struct thor_decompress_stats *stats)
+{
+	struct tar_data_src *tardata =
+		container_of(src, struct tar_data_src, src);
+
+	if (!tardata->dc)
+		return -ENOENT;
+
+	t_decomp_get_stats(tardata->dc, stats);
+	return 0;
+}
+
+int t_tar_get_data_src(const char *path, struct thor_data_src_opts *opts,
+		       struct thor_data_src **data)
 {
 	struct tar_data_src *tdata;
+	struct tar_decomp_opts dco = {0};
 	int ret;
 
 	tdata = calloc(1, sizeof(*tdata));
 	if (!tdata)
 		return -ENOMEM;
 
+	STAILQ_INIT(&tdata->ent);
+	tdata->fd = -1;
+	tdata->path = strdup(path);
+	if (!tdata->path) {
+		ret = -ENOMEM;
+		goto free_tdata;
+	}
+
+	if (opts && opts->index_cache && strcmp(path, "-")
+	    && !tar_index_get_key(path, &tdata->key)) {
+		tdata->index_cache = 1;
+		dco.key = &tdata->key;
+	}
+
+	dco.threads = opts ? opts->decompress_threads : 0;
+	if (dco.threads == THOR_DECOMPRESS_THREADS_AUTO)
+		dco.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	tdata->decomp_threads = dco.threads;
+
 	/* open the tar archive */
-	ret = tar_prep_read(path, &tdata->ar, &tdata->ae);
+	ret = tar_prep_read(path, &tdata->ar, &tdata->ae, &tdata->map, &dco);
 	if (ret)
-		goto free_tdata;
+		goto free_path;
+
+	tdata->dc = dco.dc;
+	if (!tdata->map.addr && strcmp(path, "-") && tar_is_plain(tdata))
+		tar_open_direct(tdata);
+
+	if (tdata->map.addr)
+		t_cache_init(&tdata->cache, tdata->map.fd, tdata->map.addr,
+			     tdata->map.size, opts);
+	else if (tdata->fd >= 0)
+		t_cache_init(&tdata->cache, tdata->fd, NULL, tdata->arch_size,
+			     opts);
+
+	/* Stale or broken index is rebuilt as if there was none */
+	if (tdata->index_cache) {
+		if (!tar_index_load(tdata)) {
+			ret = tar_index_finish(tdata);
+			if (ret)
+				goto release;
+		}
+	}
 
 	tdata->src.get_file_length = tar_get_file_length;
 	tdata->src.get_size = tar_get_size;
 	tdata->src.get_block = tar_get_data_block;
+	tdata->src.borrow_block = tar_borrow_data_block;
+	tdata->src.release_block = tar_release_data_block;
 	tdata->src.get_name = tar_get_file_name;
 	tdata->src.next_file = tar_next_file;
 	tdata->src.get_entries = tar_get_entries;
+	tdata->src.has_index = tar_has_index;
+	tdata->src.get_decompress_stats = tar_get_decompress_stats;
 	tdata->src.release = tar_release;
 
-	ret = tar_calculate_total(path, tdata);
-	if (ret < 0)
-		goto read_close;
-
 	*data = &tdata->src;
 	return 0;
 
-read_close:
-	archive_read_close(tdata->ar);
-	archive_entry_free(tdata->ae);
+release:
+	tar_release(&tdata->src);
+	return ret;
+free_path:
+	free(tdata->path);
 free_tdata:
 	free(tdata);
 	return ret;
@@ -0,0 +1,282 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Minimal io_uring used to keep file reads and writes in flight while the
+ * usb side is busy, with plain system calls and no extra library. Kernels
+ * without io_uring, or without its read and write operations, are told
+ * apart when the ring is set up, callers fall back to read() and write().
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "thor_internal.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define T_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#ifdef T_URING
+struct t_uring {
+	int fd;
+	unsigned int entries;
+	/* Not yet submitted to the kernel */
+	unsigned int queued;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+static int t_uring_enter(struct t_uring *ring, unsigned int submit,
+			 unsigned int wait)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+			      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+/* IORING_OP_READ and IORING_OP_WRITE came later than io_uring itself */
+static int t_uring_probe(struct t_uring *ring)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	int ret;
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (!probe)
+		return -ENOMEM;
+
+	ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+		      probe, 256);
+	if (ret < 0)
+		ret = -ENOSYS;
+	else if (probe->last_op < IORING_OP_WRITE
+		 || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+		 || !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+		ret = -ENOSYS;
+	else
+		ret = 0;
+
+	free(probe);
+	return ret;
+}
+
+void t_uring_free(struct t_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+int t_uring_new(unsigned int entries, struct t_uring **uring)
+{
+	struct io_uring_params p;
+	struct t_uring *ring;
+	void *ptr;
+	int ret;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return -ENOSYS;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array
+		+ p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP
+	    && ring->cq_ring_size > ring->sq_ring_size)
+		ring->sq_ring_size = ring->cq_ring_size;
+
+	ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sq_ring = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		ring->cq_ring = ptr;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sqes = ptr;
+
+	ring->sq_head = (void *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (void *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (void *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (void *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (void *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (void *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (void *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (void *)((char *)ring->cq_ring + p.cq_off.cqes);
+
+	ret = t_uring_probe(ring);
+	if (ret) {
+		t_uring_free(ring);
+		return ret;
+	}
+
+	*uring = ring;
+	return 0;
+fail:
+	t_uring_free(ring);
+	return -ENOSYS;
+}
+
+/* Queue read or write, it's passed to the kernel with next submit */
+int t_uring_queue(struct t_uring *ring, int write, int fd, void *buf,
+		  size_t len, off_t off, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *ring->sq_tail;
+	unsigned int idx;
+
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+	    >= ring->entries)
+		return -EBUSY;
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring->queued;
+
+	return 0;
+}
+
+int t_uring_submit(struct t_uring *ring)
+{
+	int ret;
+
+	if (!ring->queued)
+		return 0;
+
+	ret = t_uring_enter(ring, ring->queued, 0);
+	if (ret < 0)
+		return ret;
+
+	ring->queued -= ret;
+	return 0;
+}
+
+/* Wait for next completion, anything queued is submitted first */
+int t_uring_wait(struct t_uring *ring, uint64_t *user_data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head = *ring->cq_head;
+	int ret;
+
+	while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		ret = t_uring_enter(ring, ring->queued, 1);
+		if (ret < 0)
+			return ret;
+		ring->queued -= ret;
+	}
+
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+#else /* T_URING */
+int t_uring_new(unsigned int entries, struct t_uring **uring)
+{
+	return -ENOSYS;
+}
+
+void t_uring_free(struct t_uring *ring)
+{
+}
+
+int t_uring_queue(struct t_uring *ring, int write, int fd, void *buf,
+		  size_t len, off_t off, uint64_t user_data)
+{
+	return -ENOSYS;
+}
+
+int t_uring_submit(struct t_uring *ring)
+{
+	return -ENOSYS;
+}
+
+int t_uring_wait(struct t_uring *ring, uint64_t *user_data, int *res)
+{
+	return -ENOSYS;
+}
+#endif /* T_URING */
@@ -1,9 +1,11 @@
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <endian.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #ifdef __linux__
 #include <linux/usb/cdc.h>
 #else
@@ -292,10 +294,13 @@ static int find_data_eps(struct libusb_config_descriptor *cdesc,
 		    LIBUSB_TRANSFER_TYPE_BULK)
 			return -1;
 		if ((idesc->endpoint[i].bEndpointAddress & (1 << 7))
-		    == LIBUSB_ENDPOINT_IN)
+		    == LIBUSB_ENDPOINT_IN) {
 			th->data_ep_in = idesc->endpoint[i].bEndpointAddress;
-		else
+		} else {
 			th->data_ep_out = idesc->endpoint[i].bEndpointAddress;
+			th->data_ep_out_mps =
+				idesc->endpoint[i].wMaxPacketSize & 0x7ff;
+		}
 	}
 
 	if (th->data_ep_in < 0 || th->data_ep_out < 0)
@@ -489,6 +494,38 @@ void t_usb_close_device(struct thor_device_handle *th)
 		libusb_close(th->devh);
 }
 
+/*
+ * If possible transfer buffers are allocated from usbfs, so kernel may
+ * use them for DMA without copying. Otherwise fall back to heap memory.
+ */
+unsigned char *t_usb_alloc_buffer(struct thor_device_handle *th, off_t size,
+				  int *dev_mem)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	unsigned char *buf;
+
+	buf = libusb_dev_mem_alloc(th->devh, size);
+	if (buf) {
+		*dev_mem = 1;
+		return buf;
+	}
+#endif
+	*dev_mem = 0;
+	return malloc(size);
+}
+
+void t_usb_free_buffer(struct thor_device_handle *th, unsigned char *buf,
+		       off_t size, int dev_mem)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	if (dev_mem) {
+		libusb_dev_mem_free(th->devh, buf, size);
+		return;
+	}
+#endif
+	free(buf);
+}
+
 int t_usb_send(struct thor_device_handle *th, unsigned char *buf,
 	       off_t count, int timeout)
 {
@@ -615,15 +652,61 @@ int t_usb_init_transfer(struct t_usb_transfer *t,
 	return 0;
 }
 
-int t_usb_handle_events_completed(int *completed)
+/*
+ * Size of single bulk transfer used when sending data. The kernel limits
+ * memory used by all usbfs transfers (16MB by default) and large URBs
+ * may need a long contiguous buffer, so keep them at a small fraction of
+ * this limit.
+ */
+off_t t_usb_get_auto_sub_transfer_size(struct thor_device_handle *th)
+{
+	FILE *fp;
+	unsigned long mb;
+	off_t size = T_USB_AUTO_SUB_TRANSFER_SIZE;
+
+	if (th->auto_sub_transfer_size)
+		return th->auto_sub_transfer_size;
+
+	fp = fopen("/sys/module/usbcore/parameters/usbfs_memory_mb", "r");
+	if (fp) {
+		/* 0 means no limit */
+		if (fscanf(fp, "%lu", &mb) == 1 && mb
+		    && (off_t)mb*1024*1024/T_USB_SUB_TRANSFERS_PER_LIMIT < size)
+			size = (off_t)mb*1024*1024/T_USB_SUB_TRANSFERS_PER_LIMIT;
+		fclose(fp);
+	}
+
+	th->auto_sub_transfer_size = size;
+	return size;
+}
+
+static double t_usb_timediff(struct timespec *start, struct timespec *end)
 {
-	struct timeval tv = {0, 0};
+	return (end->tv_sec - start->tv_sec)
+		+ (end->tv_nsec - start->tv_nsec)/1e9;
+}
+
+/*
+ * Sleep in libusb until some transfer completes. Timeout only limits
+ * single wait, transfers have their own timeouts anyway.
+ */
+int t_usb_handle_events_completed(struct thor_device_handle *th,
+				  int *completed)
+{
+	struct timespec wall_start, wall_end, cpu_start, cpu_end;
+	struct timeval tv;
 	int ret = 0;
 
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+
 	while (!*completed) {
+		tv.tv_sec = T_USB_EVENT_TIMEOUT;
+		tv.tv_usec = 0;
 		ret = libusb_handle_events_timeout_completed(NULL,
 							     &tv,
 							     completed);
+		++th->stats.event_wakeups;
 		if (ret < 0 && ret != LIBUSB_ERROR_BUSY
 		    && ret != LIBUSB_ERROR_TIMEOUT
 		    && ret != LIBUSB_ERROR_OVERFLOW
@@ -633,6 +716,11 @@ int t_usb_handle_events_completed(int *completed)
 			ret = 0;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	th->stats.event_wall_time += t_usb_timediff(&wall_start, &wall_end);
+	th->stats.event_cpu_time += t_usb_timediff(&cpu_start, &cpu_end);
+
 	return ret;
 }
 
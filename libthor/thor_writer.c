@@ -0,0 +1,331 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Output which is written behind the caller. Data is gathered in a ring of
+ * big buffers and each one is written once it is full, through io_uring if
+ * kernel has it, by a thread of its own otherwise. The caller only waits
+ * when all buffers are on their way to disk.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "thor_internal.h"
+
+#define T_WRITER_BUFS		4
+#define T_WRITER_BUF_SIZE	(4*1024*1024)
+#define T_WRITER_ALIGN		4096
+
+struct t_writer_buf {
+	unsigned char *data;
+	off_t off;
+	size_t len;
+	size_t done;
+	/* Write of this buffer is in flight on io_uring */
+	int busy;
+};
+
+struct t_writer {
+	int fd;
+	struct t_uring *ring;
+
+	pthread_t thread;
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+
+	struct t_writer_buf bufs[T_WRITER_BUFS];
+	/* Oldest buffer handed over and number of them */
+	int head;
+	int nbusy;
+	/* Buffer being filled */
+	int fill;
+	/* Where data given next goes */
+	off_t off;
+	/* First failed write, later ones are not tried */
+	int err;
+};
+
+static ssize_t t_writer_pwrite(struct t_writer *wr, struct t_writer_buf *buf)
+{
+	ssize_t n;
+
+	while (buf->done < buf->len) {
+		n = pwrite(wr->fd, buf->data + buf->done, buf->len - buf->done,
+			   buf->off + buf->done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		buf->done += n;
+	}
+
+	return 0;
+}
+
+static void *t_writer_thread(void *arg)
+{
+	struct t_writer *wr = arg;
+	struct t_writer_buf *buf;
+	int ret = 0;
+
+	pthread_mutex_lock(&wr->lock);
+	while (!wr->stop || wr->nbusy) {
+		if (!wr->nbusy) {
+			pthread_cond_wait(&wr->cond, &wr->lock);
+			continue;
+		}
+
+		buf = &wr->bufs[wr->head];
+		if (!wr->err) {
+			pthread_mutex_unlock(&wr->lock);
+			ret = t_writer_pwrite(wr, buf);
+			pthread_mutex_lock(&wr->lock);
+		}
+
+		if (ret && !wr->err)
+			wr->err = ret;
+		wr->head = (wr->head + 1) % T_WRITER_BUFS;
+		--wr->nbusy;
+		pthread_cond_broadcast(&wr->cond);
+	}
+	pthread_mutex_unlock(&wr->lock);
+
+	return NULL;
+}
+
+static int t_writer_queue(struct t_writer *wr, int i)
+{
+	struct t_writer_buf *buf = &wr->bufs[i];
+	int ret;
+
+	ret = t_uring_queue(wr->ring, 1, wr->fd, buf->data + buf->done,
+			    buf->len - buf->done, buf->off + buf->done, i);
+	if (ret)
+		return ret;
+
+	buf->busy = 1;
+	t_uring_submit(wr->ring);
+	return 0;
+}
+
+static void t_writer_retire(struct t_writer *wr)
+{
+	while (wr->nbusy && !wr->bufs[wr->head].busy) {
+		wr->head = (wr->head + 1) % T_WRITER_BUFS;
+		--wr->nbusy;
+	}
+}
+
+/* Short writes are queued again, buffers written are given back in order */
+static int t_writer_complete(struct t_writer *wr)
+{
+	struct t_writer_buf *buf;
+	uint64_t i;
+	int res;
+	int ret;
+
+	ret = t_uring_wait(wr->ring, &i, &res);
+	if (ret)
+		return ret;
+
+	buf = &wr->bufs[i];
+	buf->busy = 0;
+	if (res <= 0 && !wr->err)
+		wr->err = res < 0 ? res : -EIO;
+	if (res > 0) {
+		buf->done += res;
+		if (buf->done < buf->len && !wr->err) {
+			ret = t_writer_queue(wr, i);
+			if (ret)
+				wr->err = ret;
+		}
+	}
+
+	t_writer_retire(wr);
+	return 0;
+}
+
+/* Buffer being filled is handed over, and a free one is waited for */
+static int t_writer_push(struct t_writer *wr)
+{
+	struct t_writer_buf *buf = &wr->bufs[wr->fill];
+	int ret = 0;
+
+	buf->done = 0;
+
+	if (wr->ring) {
+		++wr->nbusy;
+		if (!wr->err)
+			ret = t_writer_queue(wr, wr->fill);
+		if (ret)
+			wr->err = ret;
+		t_writer_retire(wr);
+		while (wr->nbusy == T_WRITER_BUFS) {
+			ret = t_writer_complete(wr);
+			if (ret)
+				return ret;
+		}
+	} else {
+		pthread_mutex_lock(&wr->lock);
+		++wr->nbusy;
+		pthread_cond_broadcast(&wr->cond);
+		while (wr->nbusy == T_WRITER_BUFS)
+			pthread_cond_wait(&wr->cond, &wr->lock);
+		pthread_mutex_unlock(&wr->lock);
+	}
+
+	wr->fill = (wr->fill + 1) % T_WRITER_BUFS;
+	wr->bufs[wr->fill].off = wr->off;
+	wr->bufs[wr->fill].len = 0;
+
+	return 0;
+}
+
+/* Data is copied, errors of earlier writes are returned */
+int t_writer_write(struct t_writer *wr, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	struct t_writer_buf *buf;
+	size_t n;
+	int ret;
+
+	while (len) {
+		buf = &wr->bufs[wr->fill];
+		n = T_WRITER_BUF_SIZE - buf->len;
+		if (n > len)
+			n = len;
+		memcpy(buf->data + buf->len, p, n);
+		buf->len += n;
+		wr->off += n;
+		p += n;
+		len -= n;
+
+		if (buf->len == T_WRITER_BUF_SIZE) {
+			ret = t_writer_push(wr);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (wr->ring)
+		return wr->err;
+
+	pthread_mutex_lock(&wr->lock);
+	ret = wr->err;
+	pthread_mutex_unlock(&wr->lock);
+
+	return ret;
+}
+
+/* Everything given so far is written when it returns */
+int t_writer_flush(struct t_writer *wr)
+{
+	int ret;
+
+	if (wr->bufs[wr->fill].len) {
+		ret = t_writer_push(wr);
+		if (ret)
+			return ret;
+	}
+
+	if (wr->ring) {
+		while (wr->nbusy) {
+			ret = t_writer_complete(wr);
+			if (ret)
+				return ret;
+		}
+		return wr->err;
+	}
+
+	pthread_mutex_lock(&wr->lock);
+	while (wr->nbusy)
+		pthread_cond_wait(&wr->cond, &wr->lock);
+	ret = wr->err;
+	pthread_mutex_unlock(&wr->lock);
+
+	return ret;
+}
+
+/* Data not flushed is written before */
+void t_writer_free(struct t_writer *wr)
+{
+	int i;
+
+	t_writer_flush(wr);
+
+	if (wr->started) {
+		pthread_mutex_lock(&wr->lock);
+		wr->stop = 1;
+		pthread_cond_broadcast(&wr->cond);
+		pthread_mutex_unlock(&wr->lock);
+		pthread_join(wr->thread, NULL);
+	}
+	if (wr->ring)
+		t_uring_free(wr->ring);
+
+	for (i = 0; i < T_WRITER_BUFS; ++i)
+		free(wr->bufs[i].data);
+	pthread_cond_destroy(&wr->cond);
+	pthread_mutex_destroy(&wr->lock);
+	free(wr);
+}
+
+/* Data is written to fd from off on, fd has to stay open until free */
+struct t_writer *t_writer_new(int fd, off_t off, int use_uring)
+{
+	struct t_writer *wr;
+	int i;
+
+	wr = calloc(1, sizeof(*wr));
+	if (!wr)
+		return NULL;
+
+	wr->fd = fd;
+	wr->off = off;
+	wr->bufs[0].off = off;
+	pthread_mutex_init(&wr->lock, NULL);
+	pthread_cond_init(&wr->cond, NULL);
+
+	for (i = 0; i < T_WRITER_BUFS; ++i) {
+		if (posix_memalign((void **)&wr->bufs[i].data, T_WRITER_ALIGN,
+				   T_WRITER_BUF_SIZE))
+			goto err;
+	}
+
+	if (use_uring && t_uring_new(T_WRITER_BUFS, &wr->ring))
+		wr->ring = NULL;
+
+	if (!wr->ring) {
+		if (pthread_create(&wr->thread, NULL, t_writer_thread, wr))
+			goto err;
+		wr->started = 1;
+	}
+
+	return wr;
+err:
+	t_writer_free(wr);
+	return NULL;
+}
@@ -0,0 +1,236 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parallel decompression of xz archives held in memory.
+ *
+ * Index at the end of each stream tells where blocks are, each block is
+ * a job of its own. Archives made by xz -T split into many blocks, single
+ * threaded xz makes just one, which is still decompressed in background.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <lzma.h>
+
+#include "thor_internal.h"
+
+struct xz_job {
+	struct t_decomp_job job;
+	const uint8_t *in;
+	size_t in_size;
+	lzma_check check;
+	lzma_vli uncompressed_size;
+	lzma_vli unpadded_size;
+	/* Used by the decoder until it's done */
+	lzma_block block;
+	lzma_stream strm;
+	int strm_init;
+};
+
+struct t_xz {
+	struct t_decomp dc;
+	const uint8_t *data;
+	size_t size;
+	lzma_index *index;
+	lzma_index_iter iter;
+};
+
+int t_xz_probe(const void *data, size_t size)
+{
+	return size >= 12 && !memcmp(data, "\xfd" "7zXZ\0", 6);
+}
+
+static void xz_free_job(struct t_decomp_job *djob)
+{
+	struct xz_job *job = container_of(djob, struct xz_job, job);
+
+	if (job->strm_init)
+		lzma_end(&job->strm);
+	free(job);
+}
+
+static int xz_job_init(struct xz_job *job)
+{
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_block *block = &job->block;
+	lzma_ret ret;
+
+	memset(block, 0, sizeof(*block));
+	block->version = 1;
+	block->check = job->check;
+	block->filters = filters;
+	block->header_size = lzma_block_header_size_decode(job->in[0]);
+	if (block->header_size > job->in_size)
+		return -EIO;
+
+	if (lzma_block_header_decode(block, NULL, job->in) != LZMA_OK)
+		return -EIO;
+
+	/* Sizes from index are checked by the decoder */
+	ret = lzma_block_compressed_size(block, job->unpadded_size);
+	if (ret == LZMA_OK) {
+		block->uncompressed_size = job->uncompressed_size;
+		memset(&job->strm, 0, sizeof(job->strm));
+		ret = lzma_block_decoder(&job->strm, block);
+	}
+	/* Filter options are needed only to set up the decoder */
+	lzma_filters_free(filters, NULL);
+	block->filters = NULL;
+	if (ret != LZMA_OK)
+		return ret == LZMA_MEM_ERROR ? -ENOMEM : -EIO;
+
+	job->strm_init = 1;
+	job->strm.next_in = job->in + block->header_size;
+	job->strm.avail_in = job->in_size - block->header_size;
+
+	return 0;
+}
+
+/* Decompress next part of block, called without lock held */
+static int xz_job_run(struct t_decomp *dc, struct t_decomp_job *djob,
+		      unsigned char *buf, size_t size, size_t *len)
+{
+	struct xz_job *job = container_of(djob, struct xz_job, job);
+	lzma_ret ret;
+	int err;
+
+	if (!job->strm_init) {
+		err = xz_job_init(job);
+		if (err)
+			return err;
+	}
+
+	job->strm.next_out = buf;
+	job->strm.avail_out = size;
+
+	while (job->strm.avail_out) {
+		ret = lzma_code(&job->strm, LZMA_FINISH);
+		if (ret == LZMA_STREAM_END) {
+			djob->finished = 1;
+			break;
+		}
+		if (ret != LZMA_OK)
+			return -EIO;
+	}
+
+	*len = size - job->strm.avail_out;
+	if (djob->finished) {
+		lzma_end(&job->strm);
+		job->strm_init = 0;
+	}
+
+	return 0;
+}
+
+/* Read indexes of all streams, going from the end of data */
+static int xz_read_index(struct t_xz *xz)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_ret ret;
+
+	ret = lzma_file_info_decoder(&strm, &xz->index, UINT64_MAX, xz->size);
+	if (ret != LZMA_OK)
+		return -ENOMEM;
+
+	strm.next_in = xz->data;
+	strm.avail_in = xz->size;
+	for (;;) {
+		ret = lzma_code(&strm, LZMA_RUN);
+		if (ret != LZMA_SEEK_NEEDED)
+			break;
+		strm.next_in = xz->data + strm.seek_pos;
+		strm.avail_in = xz->size - strm.seek_pos;
+	}
+	lzma_end(&strm);
+
+	if (ret != LZMA_STREAM_END)
+		return ret == LZMA_MEM_ERROR ? -ENOMEM : -EIO;
+
+	lzma_index_iter_init(&xz->iter, xz->index);
+	return 0;
+}
+
+/* Queue next block, called with lock held */
+static int xz_schedule(struct t_decomp *dc)
+{
+	struct t_xz *xz = container_of(dc, struct t_xz, dc);
+	struct xz_job *job;
+	int ret;
+
+	if (!xz->index) {
+		ret = xz_read_index(xz);
+		if (ret)
+			return ret;
+	}
+
+	if (lzma_index_iter_next(&xz->iter, LZMA_INDEX_ITER_BLOCK)) {
+		dc->scan_done = 1;
+		if (!dc->head)
+			dc->eof = 1;
+		return 0;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
+	t_readahead_map(xz->data, xz->size,
+			xz->iter.block.compressed_file_offset, &dc->advised);
+
+	job->in = xz->data + xz->iter.block.compressed_file_offset;
+	job->in_size = xz->iter.block.total_size;
+	job->check = xz->iter.stream.flags->check;
+	job->uncompressed_size = xz->iter.block.uncompressed_size;
+	job->unpadded_size = xz->iter.block.unpadded_size;
+	t_decomp_queue(dc, &job->job);
+
+	return 0;
+}
+
+static void xz_release(struct t_decomp *dc)
+{
+	struct t_xz *xz = container_of(dc, struct t_xz, dc);
+
+	lzma_index_end(xz->index, NULL);
+	free(xz);
+}
+
+static const struct t_decomp_ops xz_ops = {
+	.schedule = xz_schedule,
+	.run = xz_job_run,
+	.advance = t_decomp_advance_next,
+	.free_job = xz_free_job,
+	.release = xz_release,
+};
+
+struct t_decomp *t_xz_new(const void *data, size_t size, int threads)
+{
+	struct t_xz *xz;
+
+	xz = calloc(1, sizeof(*xz));
+	if (!xz)
+		return NULL;
+
+	t_decomp_init(&xz->dc, &xz_ops, threads);
+	xz->data = data;
+	xz->size = size;
+
+	return &xz->dc;
+}
@@ -0,0 +1,154 @@
+/*
+ * libthor - Tizen Thor communication protocol
+ *
+ * Licensed under the Apache License, Version 2.0 (the License);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parallel decompression of zstd archives held in memory.
+ *
+ * Frames are independent and their size is known from block headers
+ * without decompressing them, so each frame is a job of its own. Archives
+ * made by pzstd or zstd -B split into many frames, plain zstd makes just
+ * one, which is still decompressed in background.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <zstd.h>
+
+#include "thor_internal.h"
+
+struct zs_job {
+	struct t_decomp_job job;
+	ZSTD_inBuffer in;
+	ZSTD_DStream *dstream;
+};
+
+struct t_zstd {
+	struct t_decomp dc;
+	const unsigned char *data;
+	size_t size;
+	size_t scan;
+};
+
+int t_zstd_probe(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	return size >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f
+		&& p[3] == 0xfd;
+}
+
+static void zs_free_job(struct t_decomp_job *djob)
+{
+	struct zs_job *job = container_of(djob, struct zs_job, job);
+
+	ZSTD_freeDStream(job->dstream);
+	free(job);
+}
+
+/* Decompress next part of frame, called without lock held */
+static int zs_job_run(struct t_decomp *dc, struct t_decomp_job *djob,
+		      unsigned char *buf, size_t size, size_t *len)
+{
+	struct zs_job *job = container_of(djob, struct zs_job, job);
+	ZSTD_outBuffer out = { buf, size, 0 };
+	size_t ret;
+
+	if (!job->dstream) {
+		job->dstream = ZSTD_createDStream();
+		if (!job->dstream)
+			return -ENOMEM;
+	}
+
+	while (out.pos < out.size) {
+		ret = ZSTD_decompressStream(job->dstream, &out, &job->in);
+		if (ZSTD_isError(ret))
+			return -EIO;
+
+		if (!ret) {
+			djob->finished = 1;
+			ZSTD_freeDStream(job->dstream);
+			job->dstream = NULL;
+			break;
+		}
+
+		/* Frame size has been checked, so this is a corrupted one */
+		if (job->in.pos == job->in.size && out.pos < out.size)
+			return -EIO;
+	}
+
+	*len = out.pos;
+	return 0;
+}
+
+/* Queue next frame, called with lock held */
+static int zs_schedule(struct t_decomp *dc)
+{
+	struct t_zstd *zs = container_of(dc, struct t_zstd, dc);
+	struct zs_job *job;
+	size_t len;
+
+	t_readahead_map(zs->data, zs->size, zs->scan, &dc->advised);
+
+	len = ZSTD_findFrameCompressedSize(zs->data + zs->scan,
+					   zs->size - zs->scan);
+	if (ZSTD_isError(len))
+		return -EIO;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
+	job->in.src = zs->data + zs->scan;
+	job->in.size = len;
+	t_decomp_queue(dc, &job->job);
+
+	zs->scan += len;
+	if (zs->scan == zs->size)
+		dc->scan_done = 1;
+
+	return 0;
+}
+
+static void zs_release(struct t_decomp *dc)
+{
+	free(container_of(dc, struct t_zstd, dc));
+}
+
+static const struct t_decomp_ops zs_ops = {
+	.schedule = zs_schedule,
+	.run = zs_job_run,
+	.advance = t_decomp_advance_next,
+	.free_job = zs_free_job,
+	.release = zs_release,
+};
+
+struct t_decomp *t_zstd_new(const void *data, size_t size, int threads)
+{
+	struct t_zstd *zs;
+
+	zs = calloc(1, sizeof(*zs));
+	if (!zs)
+		return NULL;
+
+	t_decomp_init(&zs->dc, &zs_ops, threads);
+	zs->data = data;
+	zs->size = size;
+
+	return &zs->dc;
+}
@@ -42,19 +42,59 @@ struct dl_helper {
 	const char *name;
 };
 
+/* Transfer tuning from command line */
+struct flash_opts {
+	int queue_depth;
+	int prefetch;
+	int event_thread;
+	off_t sub_transfer_size;
+	struct thor_data_src_opts src_opts;
+	int verbose;
+	/* Session total given by the caller, -1 if it has to be counted */
+	off_t total_size;
+};
+
 struct time_data {
 	struct timeval start_time;
 	struct timeval last_time;
 	int last_sent;
+	/* Size of entries started so far in the session */
+	off_t listed;
+	int size_warned;
 };
 
-static int test_tar_file_list(char **tarfilelist)
+/* Thor protocol can't send more than 4GB in a session */
+static int check_total_size(off_t total_size, int *warned)
+{
+	if (total_size > (4*GB - 1*KB)) {
+		fprintf(stderr,
+			TERM_RED
+			"[ERROR] Images over 4GB are not supported by thor protocol.\n"
+			TERM_NORMAL);
+		return -EOVERFLOW;
+	}
+
+	if (total_size > (2*GB - 1*KB) && !*warned) {
+		fprintf(stderr,
+			TERM_RED
+			"[WARNING] Not all bootloaders support images over 2GB.\n"
+			"          If your download will fail this may be a reason.\n"
+			TERM_NORMAL);
+		*warned = 1;
+	}
+
+	return 0;
+}
+
+static int test_tar_file_list(char **tarfilelist,
+			      struct thor_data_src_opts *src_opts)
 {
 	struct thor_data_src *data;
 	int ret;
 
 	while (*tarfilelist) {
-		ret = thor_get_data_src(*tarfilelist, THOR_FORMAT_TAR, &data);
+		ret = thor_get_data_src_opts(*tarfilelist, THOR_FORMAT_TAR,
+					     src_opts, &data);
 		if (ret)
 			goto error;
 
@@ -98,7 +138,20 @@ static int count_files(char **list)
 	return i;
 }
 
+/* Archives given as "-" are read from stdin, which works just once */
+static int count_stdin(char **list)
+{
+	int n = 0;
+
+	for (; list && *list; ++list)
+		if (!strcmp(*list, "-"))
+			++n;
+
+	return n;
+}
+
 static int init_src_data_parts(const char *pitfile, char **tarfilelist,
+		    struct thor_data_src_opts *src_opts,
 		    struct dl_helper *data_parts)
 {
 	int i;
@@ -108,8 +161,8 @@ static int init_src_data_parts(const char *pitfile, char **tarfilelist,
 	if (pitfile) {
 		data_parts[0].type = THOR_PIT_DATA;
 		data_parts[0].name = pitfile;
-		ret = thor_get_data_src(pitfile, THOR_FORMAT_RAW,
-					&(data_parts[0].data));
+		ret = thor_get_data_src_opts(pitfile, THOR_FORMAT_RAW,
+					     src_opts, &(data_parts[0].data));
 		if (ret) {
 			fprintf(stderr, "Unable to open pit file %s : %d\n",
 				pitfile, ret);
@@ -121,8 +174,8 @@ static int init_src_data_parts(const char *pitfile, char **tarfilelist,
 	while (*tarfilelist) {
 		data_parts[entry].type = THOR_NORMAL_DATA;
 		data_parts[entry].name = *tarfilelist;
-		ret = thor_get_data_src(*tarfilelist, THOR_FORMAT_TAR,
-					&(data_parts[entry].data));
+		ret = thor_get_data_src_opts(*tarfilelist, THOR_FORMAT_TAR,
+					     src_opts, &(data_parts[entry].data));
 		if (ret) {
 			fprintf(stderr, "Unable to open file %s : %d\n",
 				*tarfilelist, ret);
@@ -147,14 +200,30 @@ static void init_time_data(struct time_data *tdata)
 	tdata->last_sent = 0;
 }
 
-static void report_next_entry(thor_device_handle *th,
-			      struct thor_data_src *data, void *user_data)
+static int report_next_entry(thor_device_handle *th,
+			     struct thor_data_src *data, void *user_data)
 {
 	struct time_data *tdata = user_data;
 
 	printf("[" TERM_LIGHT_GREEN "%s" TERM_NORMAL"]\n",
 	       data->get_name(data));
 	init_time_data(tdata);
+	return 0;
+}
+
+/* Entries of archives not counted up front are checked as they come */
+static int report_flash_entry(thor_device_handle *th,
+			      struct thor_data_src *data, void *user_data)
+{
+	struct time_data *tdata = user_data;
+	int ret;
+
+	tdata->listed += data->get_file_length(data);
+	ret = check_total_size(tdata->listed, &tdata->size_warned);
+	if (ret)
+		return ret;
+
+	return report_next_entry(th, data, user_data);
 }
 
 static double timediff(struct timeval *atv, struct timeval *btv)
@@ -206,13 +275,51 @@ static void report_progress(thor_device_handle *th, struct thor_data_src *data,
 	}
 }
 
+static const char *buffer_mode_str(enum thor_buffer_mode mode)
+{
+	switch (mode) {
+	case THOR_BUFFER_HEAP:
+		return "heap";
+	case THOR_BUFFER_DEV_MEM:
+		return "usbfs device memory";
+	case THOR_BUFFER_MIXED:
+		return "usbfs device memory and heap";
+	default:
+		return "none";
+	}
+}
+
+static void report_decompress_stats(struct thor_data_src *data)
+{
+	struct thor_decompress_stats stats;
+	double mb;
+	int i;
+
+	if (!data->get_decompress_stats
+	    || data->get_decompress_stats(data, &stats))
+		return;
+
+	for (i = 0; i < stats.nthreads; ++i) {
+		mb = stats.threads[i].bytes / (1024.0 * 1024.0);
+		fprintf(stderr, "decompress thread %2d : %.1lf MB in %.3lfs",
+			i, mb, stats.threads[i].busy_time);
+		if (stats.threads[i].busy_time > 0)
+			fprintf(stderr, " (%.1lf MB/s)",
+				mb / stats.threads[i].busy_time);
+		fprintf(stderr, "\n");
+	}
+}
+
 static int do_flash(thor_device_handle *th, struct dl_helper *data_parts,
-		       int entries, off_t total_size)
+		    int entries, off_t total_size, struct flash_opts *fopts)
 {
 	struct time_data tdata;
 	int i;
 	int ret;
 
+	tdata.listed = 0;
+	tdata.size_warned = total_size > (2*GB - 1*KB);
+
 	ret = thor_start_session(th, total_size);
 	if (ret) {
 		fprintf(stderr, "Unable to start download session: %d\n", ret);
@@ -232,7 +339,7 @@ static int do_flash(thor_device_handle *th, struct dl_helper *data_parts,
 		}
 
 		ret = thor_send_data(th, data_parts[i].data, data_parts[i].type,
-				     report_progress, &tdata, report_next_entry,
+				     report_progress, &tdata, report_flash_entry,
 				     &tdata);
 		if (ret) {
 			fprintf(stderr, "\nfailed to download %s: %d\n",
@@ -240,6 +347,20 @@ static int do_flash(thor_device_handle *th, struct dl_helper *data_parts,
 			goto out;
 		}
 
+		if (fopts->verbose)
+			report_decompress_stats(data_parts[i].data);
+	}
+
+	if (fopts->verbose) {
+		struct thor_stats stats;
+
+		fprintf(stderr, "\ntransfer buffers : %s\n",
+			buffer_mode_str(thor_get_buffer_mode(th)));
+
+		if (!thor_get_stats(th, &stats))
+			fprintf(stderr, "usb event loop   : %lu wakeups, "
+				"%.3lfs cpu in %.3lfs\n", stats.event_wakeups,
+				stats.event_cpu_time, stats.event_wall_time);
 	}
 
 	ret = thor_end_session(th);
@@ -261,10 +382,13 @@ out:
 }
 
 static int process_flash(struct thor_device_id *dev_id, int opt_sd,
+			 struct flash_opts *fopts,
 			 const char *pitfile, char **tarfilelist)
 {
 	thor_device_handle *th;
 	off_t total_size = 0;
+	int unindexed = 0;
+	int size_warned = 0;
 	struct dl_helper *data_parts;
 	int nfiles;
 	int entries = 0;
@@ -289,6 +413,30 @@ static int process_flash(struct thor_device_id *dev_id, int opt_sd,
 		return ret;
 	}
 
+	ret = thor_set_queue_depth(th, fopts->queue_depth);
+	if (ret) {
+		fprintf(stderr, "Unable to set queue depth: %d\n", ret);
+		goto close_dev;
+	}
+
+	ret = thor_set_prefetch(th, fopts->prefetch);
+	if (ret) {
+		fprintf(stderr, "Unable to set prefetch: %d\n", ret);
+		goto close_dev;
+	}
+
+	ret = thor_set_event_thread(th, fopts->event_thread);
+	if (ret) {
+		fprintf(stderr, "Unable to start usb event thread: %d\n", ret);
+		goto close_dev;
+	}
+
+	ret = thor_set_sub_transfer_size(th, fopts->sub_transfer_size);
+	if (ret) {
+		fprintf(stderr, "Unable to set sub-transfer size: %d\n", ret);
+		goto close_dev;
+	}
+
 	nfiles = count_files(tarfilelist) + (pitfile ? 1 : 0);
 
 	data_parts = calloc(nfiles, sizeof(*data_parts));
@@ -297,20 +445,42 @@ static int process_flash(struct thor_device_id *dev_id, int opt_sd,
 		goto close_dev;
 	}
 
-	entries = init_src_data_parts(pitfile, tarfilelist, data_parts);
+	entries = init_src_data_parts(pitfile, tarfilelist, &fopts->src_opts,
+				      data_parts);
 	if (entries < 0) {
 		ret = entries;
 		goto free_data_parts;
 	}
 
-	/* Count the total size of data */
+	/*
+	 * Count the total size of data. Compressed archives would have to be
+	 * unpacked twice for that, so unless they are indexed they are left
+	 * out and only listed while sending, which is also how archives piped
+	 * to stdin are read in just one pass. Size limits are checked again
+	 * as entries are sent. Total size sent to the target is just
+	 * informative, it may be given on command line instead.
+	 */
 	for (i = 0; i < entries; ++i) {
 		struct thor_data_src *dsrc = data_parts[i].data;
-		off_t size = dsrc->get_size(dsrc);
+		off_t size;
 		struct thor_data_src_entry **ent;
 
 		printf(TERM_YELLOW "%s :\n" TERM_NORMAL, data_parts[i].name);
 
+		if (dsrc->has_index && !dsrc->has_index(dsrc)) {
+			printf("\t(compressed, entries listed while sending)\n");
+			++unindexed;
+			continue;
+		}
+
+		size = dsrc->get_size(dsrc);
+		if (size < 0) {
+			fprintf(stderr, "Unable to read %s : %d\n",
+				data_parts[i].name, (int)size);
+			ret = size;
+			goto release_data_srcs;
+		}
+
 		for (ent = dsrc->get_entries(dsrc); ent && *ent; ++ent)
 			printf("[" TERM_LIGHT_GREEN "%s" TERM_NORMAL "]"
 			       "\t %jdk\n",
@@ -320,28 +490,25 @@ static int process_flash(struct thor_device_id *dev_id, int opt_sd,
 		total_size += size;
 	}
 
+	if (fopts->total_size >= 0) {
+		if (fopts->total_size < total_size)
+			fprintf(stderr, TERM_YELLOW "[WARNING] Given total size "
+				"is smaller than size of indexed archives.\n"
+				TERM_NORMAL);
+		total_size = fopts->total_size;
+		unindexed = 0;
+	}
+
 	printf("-------------------------\n");
-	printf("\t" TERM_YELLOW "total" TERM_NORMAL" :\t%.2fMB\n\n",
-	       (double)total_size/MB);
+	printf("\t" TERM_YELLOW "total" TERM_NORMAL" :\t%.2fMB%s\n\n",
+	       (double)total_size/MB,
+	       unindexed ? " + streamed archives" : "");
 
-	if (total_size > (4*GB - 1*KB)) {
-		fprintf(stderr,
-			TERM_RED
-			"[ERROR] Images over 4GB are not supported by thor protocol.\n"
-			TERM_NORMAL);
-		ret = -EOVERFLOW;
+	ret = check_total_size(total_size, &size_warned);
+	if (ret)
 		goto release_data_srcs;
-	}
 
-	if (total_size > (2*GB - 1*KB)) {
-		fprintf(stderr,
-			TERM_RED
-			"[WARNING] Not all bootloaders support images over 2GB.\n"
-			"          If your download will fail this may be a reason.\n"
-			TERM_NORMAL);
-	}
-
-	ret = do_flash(th, data_parts, entries, total_size);
+	ret = do_flash(th, data_parts, entries, total_size, fopts);
 
 release_data_srcs:
 	for (i = 0; i < entries; ++i)
@@ -442,6 +609,7 @@ out:
 }
 
 static int process_dump(struct thor_device_id *dev_id, int opt_sd,
+			 struct thor_data_src_opts *src_opts,
 			 const char *pitfile, char **tarfilelist)
 {
 	thor_device_handle *th;
@@ -470,8 +638,8 @@ static int process_dump(struct thor_device_id *dev_id, int opt_sd,
 
 	data_parts[0].type = THOR_PIT_DATA;
 	data_parts[0].name = pitfile;
-	ret = thor_get_data_dest(pitfile, THOR_FORMAT_RAW,
-				 &(data_parts[0].data));
+	ret = thor_get_data_dest_opts(pitfile, THOR_FORMAT_RAW, src_opts,
+				      &(data_parts[0].data));
 	if (ret < 0) {
 		fprintf(stderr, "Unable to open pit file %s for dump: %s\n",
 			pitfile, strerror(-ret));
@@ -512,8 +680,20 @@ static void usage(const char *exename)
 		"  --vendor-id=<vid>                  Use device with given Vendor ID\n"
 		"  --product-id=<pid>                 Use device with given Product ID\n"
 		"  --serial=<serialno>                Use device with given Serial Number\n"
+		"  --queue-depth=<n|auto>             Number of transfer units kept in flight (default %d)\n"
+		"  --prefetch=<n>                     Number of transfer units read ahead, 0 disables (default %d)\n"
+		"  --event-thread                     Handle usb events in a separate thread\n"
+		"  --sub-transfer=<bytes|auto>        Size of single bulk transfer (default auto)\n"
+		"  --index-cache                      Keep index of each tar next to it as <tar>.thor-idx and reuse it\n"
+		"  --decompress-threads=<n|auto>      Threads decompressing tar archives, 1 disables (default auto)\n"
+		"  --total-size=<bytes>               Total size of flashed data, instead of counting it\n"
+		"  --readahead=<bytes|auto>           Bytes of files read ahead of what is sent, 0 disables (default auto)\n"
+		"  --drop-cache                       Drop sent files from page cache\n"
+		"  --direct-io                        Read raw images bypassing page cache, if possible\n"
+		"  --no-io-uring                      Don't use io_uring to read images and write dumps\n"
+		"  --compress=<zstd|lz4>[:<level>]    Write dumps compressed, at given level if any\n"
 		"  --help                             Print this help message\n",
-		exename);
+		exename, THOR_DEFAULT_QUEUE_DEPTH, THOR_DEFAULT_PREFETCH);
 	exit(1);
 }
 
@@ -524,9 +704,16 @@ int main(int argc, char **argv)
 	int opt_flash = 0;
 	int opt_dump = 0;
 	int opt_test = 0;
-	int opt_verbose = 0; /* unused for now */
 	int opt_check = 0;
 	int opt_sd = 0;
+	struct flash_opts fopts = {
+		.queue_depth = THOR_DEFAULT_QUEUE_DEPTH,
+		.prefetch = THOR_DEFAULT_PREFETCH,
+		.event_thread = 0,
+		.sub_transfer_size = THOR_SUB_TRANSFER_AUTO,
+		.verbose = 0,
+		.total_size = -1,
+	};
 	int optindex;
 	int ret;
 	struct thor_device_id dev_id = {
@@ -551,6 +738,18 @@ int main(int argc, char **argv)
 		{"vendor-id", required_argument, 0, 1},
 		{"product-id", required_argument, 0, 2},
 		{"serial", required_argument, 0, 3},
+		{"queue-depth", required_argument, 0, 4},
+		{"prefetch", required_argument, 0, 5},
+		{"event-thread", no_argument, 0, 6},
+		{"sub-transfer", required_argument, 0, 7},
+		{"index-cache", no_argument, 0, 8},
+		{"decompress-threads", required_argument, 0, 9},
+		{"total-size", required_argument, 0, 10},
+		{"readahead", required_argument, 0, 11},
+		{"drop-cache", no_argument, 0, 12},
+		{"direct-io", no_argument, 0, 13},
+		{"no-io-uring", no_argument, 0, 14},
+		{"compress", required_argument, 0, 15},
 		{"help", no_argument, 0, 0},
 		{0, 0, 0, 0}
 	};
@@ -585,7 +784,7 @@ int main(int argc, char **argv)
 			opt_test = 1;
 			break;
 		case 'v':
-			opt_verbose = 1;
+			fopts.verbose = 1;
 			break;
 		case 'c':
 			opt_check = 1;
@@ -651,6 +850,221 @@ int main(int argc, char **argv)
 		case 3:
 			dev_id.serial = optarg;
 			break;
+		case 4:
+		{
+			unsigned long int val;
+			char *endptr = NULL;
+
+			if (!strcmp(optarg, "auto")) {
+				fopts.queue_depth = THOR_QUEUE_DEPTH_ADAPTIVE;
+				break;
+			}
+
+			val = strtoul(optarg, &endptr, 0);
+			if (*optarg == '\0'
+			    || (endptr && *endptr != '\0')) {
+				fprintf(stderr,
+					"Invalid value type for --queue-depth option.\n"
+					"Expected a number or auto but got: %s", optarg);
+				exit(-1);
+			}
+
+			if (val < 1 || val > THOR_MAX_QUEUE_DEPTH) {
+				fprintf(stderr,
+					"Value of --queue-depth out of range\n");
+				exit(-1);
+			}
+
+			fopts.queue_depth = (int)val;
+			break;
+		}
+		case 5:
+		{
+			unsigned long int val;
+			char *endptr = NULL;
+
+			val = strtoul(optarg, &endptr, 0);
+			if (*optarg == '\0'
+			    || (endptr && *endptr != '\0')) {
+				fprintf(stderr,
+					"Invalid value type for --prefetch option.\n"
+					"Expected a number but got: %s", optarg);
+				exit(-1);
+			}
+
+			if (val > THOR_MAX_QUEUE_DEPTH) {
+				fprintf(stderr,
+					"Value of --prefetch out of range\n");
+				exit(-1);
+			}
+
+			fopts.prefetch = (int)val;
+			break;
+		}
+		case 6:
+			fopts.event_thread = 1;
+			break;
+		case 7:
+		{
+			unsigned long long int val;
+			char *endptr = NULL;
+
+			if (!strcmp(optarg, "auto")) {
+				fopts.sub_transfer_size = THOR_SUB_TRANSFER_AUTO;
+				break;
+			}
+
+			val = strtoull(optarg, &endptr, 0);
+			if (*optarg == '\0'
+			    || (endptr && *endptr != '\0')) {
+				fprintf(stderr,
+					"Invalid value type for --sub-transfer option.\n"
+					"Expected a number or auto but got: %s", optarg);
+				exit(-1);
+			}
+
+			if (val == 0 || val > INT32_MAX) {
+				fprintf(stderr,
+					"Value of --sub-transfer out of range\n");
+				exit(-1);
+			}
+
+			fopts.sub_transfer_size = (off_t)val;
+			break;
+		}
+		case 8:
+			fopts.src_opts.index_cache = 1;
+			break;
+		case 9:
+		{
+			unsigned long int val;
+			char *endptr = NULL;
+
+			if (!strcmp(optarg, "auto")) {
+				fopts.src_opts.decompress_threads =
+					THOR_DECOMPRESS_THREADS_AUTO;
+				break;
+			}
+
+			val = strtoul(optarg, &endptr, 0);
+			if (*optarg == '\0'
+			    || (endptr && *endptr != '\0')) {
+				fprintf(stderr,
+					"Invalid value type for --decompress-threads option.\n"
+					"Expected a number or auto but got: %s", optarg);
+				exit(-1);
+			}
+
+			if (val < 1 || val > THOR_MAX_DECOMPRESS_THREADS) {
+				fprintf(stderr,
+					"Value of --decompress-threads out of range\n");
+				exit(-1);
+			}
+
+			fopts.src_opts.decompress_threads = (int)val;
+			break;
+		}
+		case 10:
+		{
+			unsigned long long int val;
+			char *endptr = NULL;
+
+			val = strtoull(optarg, &endptr, 0);
+			if (*optarg == '\0'
+			    || (endptr && *endptr != '\0')) {
+				fprintf(stderr,
+					"Invalid value type for --total-size option.\n"
+					"Expected a number but got: %s", optarg);
+				exit(-1);
+			}
+
+			if (val > INT64_MAX) {
+				fprintf(stderr,
+					"Value of --total-size out of range\n");
+				exit(-1);
+			}
+
+			fopts.total_size = (off_t)val;
+			break;
+		}
+		case 11:
+		{
+			unsigned long long int val;
+			char *endptr = NULL;
+
+			if (!strcmp(optarg, "auto")) {
+				fopts.src_opts.readahead = THOR_READAHEAD_AUTO;
+				break;
+			}
+
+			val = strtoull(optarg, &endptr, 0);
+			if (*optarg == '\0'
+			    || (endptr && *endptr != '\0')) {
+				fprintf(stderr,
+					"Invalid value type for --readahead option.\n"
+					"Expected a number or auto but got: %s", optarg);
+				exit(-1);
+			}
+
+			if (val > INT32_MAX) {
+				fprintf(stderr,
+					"Value of --readahead out of range\n");
+				exit(-1);
+			}
+
+			fopts.src_opts.readahead = val ? (off_t)val
+						       : THOR_READAHEAD_NONE;
+			break;
+		}
+		case 12:
+			fopts.src_opts.drop_cache = 1;
+			break;
+		case 13:
+			fopts.src_opts.direct_io = 1;
+			break;
+		case 14:
+			fopts.src_opts.no_io_uring = 1;
+			break;
+		case 15:
+		{
+			long int val = 0;
+			char *level;
+			char *endptr = NULL;
+
+			level = strchr(optarg, ':');
+			if (level)
+				*level++ = '\0';
+
+			if (!strcmp(optarg, "zstd")) {
+				fopts.src_opts.compress = THOR_COMPRESS_ZSTD;
+			} else if (!strcmp(optarg, "lz4")) {
+				fopts.src_opts.compress = THOR_COMPRESS_LZ4;
+			} else {
+				fprintf(stderr,
+					"Invalid format for --compress option.\n"
+					"Expected zstd or lz4 but got: %s", optarg);
+				exit(-1);
+			}
+
+			if (level)
+				val = strtol(level, &endptr, 0);
+			if (level && (*level == '\0'
+				      || (endptr && *endptr != '\0'))) {
+				fprintf(stderr,
+					"Invalid level for --compress option.\n"
+					"Expected a number but got: %s", level);
+				exit(-1);
+			}
+
+			if (val < -100 || val > 100) {
+				fprintf(stderr,
+					"Level of --compress out of range\n");
+				exit(-1);
+			}
+
+			fopts.src_opts.compress_level = (int)val;
+			break;
+		}
 		case 0:
 		default:
 			usage(exename);
@@ -672,15 +1086,22 @@ int main(int argc, char **argv)
 		return -1;	/* not reached */
 	}
 
+	if (count_stdin(&(argv[optind])) > 1) {
+		fprintf(stderr, "stdin can be read only once\n");
+		return -1;
+	}
+
 	ret = 0;
 	if (opt_test)
-		ret = test_tar_file_list(&(argv[optind]));
+		ret = test_tar_file_list(&(argv[optind]), &fopts.src_opts);
 	else if (opt_check)
 		ret = check_proto(&dev_id);
 	else if (opt_flash)
-		ret = process_flash(&dev_id, opt_sd, pitfile, &(argv[optind]));
+		ret = process_flash(&dev_id, opt_sd, &fopts, pitfile,
+				    &(argv[optind]));
 	else if (opt_dump)
-		ret = process_dump(&dev_id, opt_sd, pitfile, &(argv[optind]));
+		ret = process_dump(&dev_id, opt_sd, &fopts.src_opts, pitfile,
+				   &(argv[optind]));
 	else
 		usage(exename);
 